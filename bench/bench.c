@@ -0,0 +1,123 @@
+// Microbenchmarks of the overhead of wrapped calls for a few function shapes.
+// The harness itself is never wrapped, so that only the calls to the
+// benchmarked functions are measured. Results go to stderr since some macros
+// print to stdout.
+
+#include "../macro.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define NOINLINE __attribute__((noinline))
+
+struct large
+{
+  long values[8];
+};
+
+static volatile int sink;
+
+NOINLINE void leaf(void)
+{
+  __asm__ __volatile__("" ::: "memory");
+}
+
+NOINLINE int bar(int n)
+{
+  return n * 3 + 1;
+}
+
+NOINLINE struct large large(int n)
+{
+  struct large result;
+  for(int i=0; i<8; ++i)
+    result.values[i] = n + i;
+  return result;
+}
+
+NOINLINE int baz(int n, ...)
+{
+  va_list ap;
+  va_start(ap, n);
+  int sum = 0;
+  for(int i=0; i<n; ++i)
+    sum += va_arg(ap, int);
+  va_end(ap);
+  return sum;
+}
+
+// The barrier keeps the recursion from being turned into a loop.
+NOINLINE int recurse(int depth)
+{
+  if(depth == 0)
+    return 0;
+
+  int result = recurse(depth - 1);
+  __asm__ __volatile__("" : "+r"(result));
+  return result + 1;
+}
+
+MACRO_SKIP static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+MACRO_SKIP static void report(const char *name, double start, long calls)
+{
+  fprintf(stderr, "%s %.2f\n", name, (now() - start) / calls);
+}
+
+MACRO_SKIP int main(int argc, char **argv)
+{
+  long iterations = argc > 1 ? atol(argv[1]) : 10000000;
+  const char *only = argc > 2 ? argv[2] : NULL;
+  double start;
+
+  if(!only || strcmp(only, "leaf") == 0)
+  {
+    start = now();
+    for(long i=0; i<iterations; ++i)
+      leaf();
+    report("leaf", start, iterations);
+  }
+
+  if(!only || strcmp(only, "scalar") == 0)
+  {
+    start = now();
+    for(long i=0; i<iterations; ++i)
+      sink = bar(i);
+    report("scalar", start, iterations);
+  }
+
+  if(!only || strcmp(only, "large") == 0)
+  {
+    start = now();
+    for(long i=0; i<iterations; ++i)
+      sink = large(i).values[7];
+    report("large", start, iterations);
+  }
+
+  if(!only || strcmp(only, "varargs") == 0)
+  {
+    start = now();
+    for(long i=0; i<iterations; ++i)
+      sink = baz(3, (int)i, 2, 3);
+    report("varargs", start, iterations);
+  }
+
+  // Every iteration makes 100 nested calls.
+  if(!only || strcmp(only, "recursion") == 0)
+  {
+    start = now();
+    for(long i=0; i<iterations / 100; ++i)
+      sink = recurse(99);
+    report("recursion", start, iterations / 100 * 100);
+  }
+
+  return 0;
+}
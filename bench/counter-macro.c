@@ -0,0 +1,9 @@
+#include "../macro.h"
+
+// Counts the calls to every function, which is about the cheapest useful
+// instrumentation.
+void macro_def(void)
+{
+  ++macro_local(unsigned long);
+  macro_call();
+}
@@ -0,0 +1,7 @@
+#include "../macro.h"
+
+// Baseline macro which only calls the original function.
+void macro_def(void)
+{
+  macro_call();
+}
@@ -0,0 +1,12 @@
+#!/bin/sh
+# Generate a C source file with the given number of small functions calling
+# each other, as input to the compile time benchmark.
+#
+# Usage: gen-module.sh <count>
+
+awk -v count="$1" 'BEGIN {
+  print "int external(int);"
+  print "int f0(int x) { return external(x); }"
+  for(i = 1; i < count; ++i)
+    printf "int f%d(int x) { return x > %d ? f%d(x - 1) + %d : external(x) * %d; }\n", i, i, i - 1, i, i
+}'
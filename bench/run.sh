@@ -0,0 +1,82 @@
+#!/bin/sh
+# Measure the run time overhead of wrapped calls and the compile time cost of
+# the pass. Invoked by `make bench` from the top level directory once
+# libmacro.so and test-macro.bc are built.
+#
+# Environment:
+#   BENCH_CC          C compiler (default: clang)
+#   BENCH_ITERATIONS  calls per function shape (default: 10000000)
+#   BENCH_SIZES       numbers of functions of the synthetic modules
+#                     (default: 1000 10000 100000)
+#   BENCH_OUT         directory for build products (default: bench/out)
+
+set -e
+
+CC=${BENCH_CC:-clang}
+ITERATIONS=${BENCH_ITERATIONS:-10000000}
+SIZES=${BENCH_SIZES:-1000 10000 100000}
+OUT=${BENCH_OUT:-bench/out}
+OPT=$(llvm-config --bindir)/opt
+
+PLUGIN="-fplugin=./libmacro.so -fpass-plugin=./libmacro.so"
+SHAPES="leaf scalar large varargs recursion"
+MACROS="none empty counter test-macro"
+
+mkdir -p "$OUT"
+# The macros are built with -fexceptions like any macro which may wrap C++
+# code, so that they are not nounwind.
+for macro in empty counter; do
+  $CC -fexceptions -Xclang -disable-O0-optnone -c -emit-llvm -o "$OUT/$macro-macro.bc" "bench/$macro-macro.c"
+done
+
+echo "# Wrapped call overhead (ns per call)"
+for level in -O0 -O2 -O3; do
+  for macro in $MACROS; do
+    iterations=$ITERATIONS
+    case $macro in
+    none)
+      flags= ;;
+    test-macro)
+      # test-macro.cpp prints on every call.
+      flags="$PLUGIN -mllvm -macro -mllvm test-macro.bc"
+      iterations=$((ITERATIONS / 100)) ;;
+    *)
+      flags="$PLUGIN -mllvm -macro -mllvm $OUT/$macro-macro.bc" ;;
+    esac
+
+    $CC $level $flags -o "$OUT/bench$level-$macro" bench/bench.c
+    "$OUT/bench$level-$macro" "$iterations" 2>"$OUT/bench$level-$macro.txt" >/dev/null
+  done
+
+  echo
+  printf "%-10s" "$level"
+  for macro in $MACROS; do
+    printf " %12s" "$macro"
+  done
+  echo
+  for shape in $SHAPES; do
+    printf "%-10s" "$shape"
+    for macro in $MACROS; do
+      printf " %12s" "$(awk -v shape="$shape" '$1 == shape { print $2 }' "$OUT/bench$level-$macro.txt")"
+    done
+    echo
+  done
+done
+
+echo
+echo "# Compile time (counter macro, -O2 code size)"
+echo
+printf "%-10s %12s %12s %12s %10s\n" "functions" "pass (s)" "text" "text+macro" "growth"
+for size in $SIZES; do
+  sh bench/gen-module.sh "$size" >"$OUT/gen-$size.c"
+  $CC -Xclang -disable-O0-optnone -c -emit-llvm -o "$OUT/gen-$size.bc" "$OUT/gen-$size.c"
+  "$OPT" -load-pass-plugin ./libmacro.so -passes=macro-module-pass -macro "$OUT/counter-macro.bc" -time-passes "$OUT/gen-$size.bc" -o "$OUT/gen-$size-macro.bc" 2>"$OUT/gen-$size-time.txt"
+  seconds=$(sed -n 's/.*[^0-9]\([0-9][0-9]*\.[0-9]*\) *([ 0-9.]*%) *MacroModulePass.*/\1/p' "$OUT/gen-$size-time.txt" | head -n 1)
+
+  $CC -O2 -c -o "$OUT/gen-$size.o" "$OUT/gen-$size.bc"
+  $CC -O2 -c -o "$OUT/gen-$size-macro.o" "$OUT/gen-$size-macro.bc"
+  text=$(size "$OUT/gen-$size.o" | awk 'NR == 2 { print $1 }')
+  macro_text=$(size "$OUT/gen-$size-macro.o" | awk 'NR == 2 { print $1 }')
+
+  printf "%-10s %12s %12s %12s %9.1f%%\n" "$size" "$seconds" "$text" "$macro_text" "$(echo "$text $macro_text" | awk '{ print ($2 - $1) * 100 / $1 }')"
+done
@@ -0,0 +1,13 @@
+#include "../macro.h"
+#include "check.h"
+
+unsigned long check_macro_calls;
+
+// Reports every call to the checks, which compare what the macro observed
+// with the calls the program made.
+void macro_def(void)
+{
+  unsigned long calls = __atomic_add_fetch(&check_macro_calls, 1, __ATOMIC_RELAXED);
+  check_enter(macro_function_name(), macro_source_file(), macro_index(), macro_count(), calls, &macro_local(struct check_slab));
+  macro_call();
+}
@@ -0,0 +1,7 @@
+// Second source file of the checks, so that sharing and indices are checked
+// across modules.
+
+extern "C" int other_square(int n)
+{
+  return n * n;
+}
@@ -0,0 +1,240 @@
+// Behaviour checks of the pass, run by check/run.sh with check-macro.c applied
+// under the options of the mode given as the first argument. Every call the
+// macro observes is recorded by check_enter() and compared with the calls the
+// program made. The checks themselves are never wrapped.
+
+#include "../macro.h"
+#include "../macro_runtime.h"
+#include "check.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct record
+{
+  const char *name;
+  const char *file;
+  size_t index;
+  size_t count;
+  struct check_slab *slab;
+  unsigned long hits;
+  unsigned long calls;
+};
+
+static struct record records[64];
+static size_t record_count;
+static const char *mode = "default";
+static int failures;
+
+MACRO_SKIP static void check_fail(const char *format, ...)
+{
+  va_list ap;
+  va_start(ap, format);
+  fprintf(stderr, "check %s: ", mode);
+  vfprintf(stderr, format, ap);
+  fprintf(stderr, "\n");
+  va_end(ap);
+  ++failures;
+}
+
+MACRO_SKIP static struct record *check_find(const char *name)
+{
+  for(size_t i=0; i<record_count; ++i)
+    if(strcmp(records[i].name, name) == 0)
+      return &records[i];
+  return NULL;
+}
+
+extern "C" MACRO_SKIP void check_enter(const char *name, const char *file, size_t index, size_t count, unsigned long calls, struct check_slab *slab)
+{
+  struct record *record = check_find(name);
+  if(!record)
+  {
+    if(record_count == sizeof records / sizeof *records)
+      abort();
+
+    record = &records[record_count++];
+    record->name = name;
+    record->file = file;
+    record->index = index;
+    record->count = count;
+    record->slab = slab;
+  }
+
+  if(record->index != index || record->count != count || record->slab != slab)
+    check_fail("%s: index, count or macro local variable changed between calls", name);
+
+  // Every word of the macro local variable holds the number of previous
+  // calls, so that storage which is not zeroed, or shared with or overlapping
+  // that of another function, is caught.
+  const size_t words = sizeof slab->words / sizeof *slab->words;
+  for(size_t i=0; i<words; ++i)
+    if(slab->words[i] != record->hits)
+    {
+      check_fail("%s: word %zu of the macro local variable is %lu instead of %lu", name, i, slab->words[i], record->hits);
+      break;
+    }
+
+  ++record->hits;
+  for(size_t i=0; i<words; ++i)
+    slab->words[i] = record->hits;
+
+  if(calls > record->calls)
+    record->calls = calls;
+}
+
+MACRO_SKIP static void check_hits(const char *name, unsigned long expected)
+{
+  struct record *record = check_find(name);
+  unsigned long hits = record ? record->hits : 0;
+  if(hits != expected)
+    check_fail("%s: the macro ran %lu times instead of %lu", name, hits, expected);
+}
+
+// Indices are unique and below the count within a source file, or over the
+// whole program with -macro-index-scope=program.
+MACRO_SKIP static void check_indices(bool program)
+{
+  for(size_t i=0; i<record_count; ++i)
+  {
+    if(records[i].index >= records[i].count)
+      check_fail("%s: index %zu is not below the count %zu", records[i].name, records[i].index, records[i].count);
+
+    for(size_t j=0; j<i; ++j)
+      if(program || strcmp(records[i].file, records[j].file) == 0)
+      {
+        if(records[i].index == records[j].index)
+          check_fail("%s and %s: both have index %zu", records[i].name, records[j].name, records[i].index);
+        if(records[i].count != records[j].count)
+          check_fail("%s and %s: counts %zu and %zu differ", records[i].name, records[j].name, records[i].count, records[j].count);
+      }
+  }
+}
+
+// The counter defined by the macro counts the calls of the whole program with
+// -macro-comdat, and of each source file otherwise.
+MACRO_SKIP static void check_counter(bool comdat)
+{
+  for(size_t i=0; i<record_count; ++i)
+  {
+    unsigned long hits = 0;
+    unsigned long calls = 0;
+    for(size_t j=0; j<record_count; ++j)
+      if(comdat || strcmp(records[i].file, records[j].file) == 0)
+      {
+        hits += records[j].hits;
+        if(records[j].calls > calls)
+          calls = records[j].calls;
+      }
+
+    if(calls != hits)
+      check_fail("%s: the counter of the macro reached %lu instead of %lu", records[i].file, calls, hits);
+  }
+}
+
+// Every function descriptor points to the enable flag of the same function.
+MACRO_SKIP static void check_descriptors(void)
+{
+  size_t functions = 0;
+  for(size_t i=0; i<macro_descriptor_count(); ++i)
+  {
+    const struct macro_descriptor *descriptor = macro_descriptor_at(i);
+    if(descriptor->kind != MACRO_DESCRIPTOR_FUNCTION)
+      continue;
+
+    size_t index = macro_descriptor_enable_index(descriptor);
+    if(index >= macro_function_count() || strcmp(macro_function_name_at(index), descriptor->name) != 0)
+      check_fail("%s: the descriptor does not point to the enable flag of the function", descriptor->name);
+    ++functions;
+  }
+
+  if(functions == 0 || functions != macro_function_count())
+    check_fail("%zu function descriptors for %zu enable flags", functions, macro_function_count());
+}
+
+MACRO_SKIP static void check_set_enabled(const char *name, int enabled)
+{
+  if(macro_set_enabled_by_name(name, enabled) != 1)
+    check_fail("%s: not found among the enable flags", name);
+}
+
+extern "C" int other_square(int n);
+
+extern "C" int twice(int n)
+{
+  return 2 * n;
+}
+
+// Exceptions unwind through the macro, which is compiled from C with
+// -fexceptions.
+extern "C" void fail(int n)
+{
+  if(n != 0)
+    throw n;
+}
+
+extern "C" int recover(int n)
+{
+  try
+  {
+    fail(n);
+  }
+  catch(int e)
+  {
+    return e;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  if(argc > 1)
+    mode = argv[1];
+
+  bool enable = strcmp(mode, "enable") == 0;
+  unsigned long period = strcmp(mode, "sample") == 0 ? 4 : 1;
+
+  // With -macro-enable=default-off, nothing runs the macro until enabled.
+  if(enable)
+  {
+    check_descriptors();
+    check_set_enabled("twice", 1);
+    check_set_enabled("other_square", 1);
+    check_set_enabled("fail", 1);
+    check_set_enabled("recover", 1);
+  }
+
+  int sum = 0;
+  for(int i=0; i<100; ++i)
+    sum += twice(i) + other_square(i);
+  if(sum != 338250)
+    check_fail("the wrapped functions computed %d instead of 338250", sum);
+
+  if(recover(7) != 7)
+    check_fail("the exception was not caught through the macro");
+
+  if(enable)
+  {
+    check_set_enabled("twice", 0);
+    for(int i=0; i<10; ++i)
+      twice(i);
+  }
+
+  // With sampling, the first call of every function runs the macro and then
+  // every period-th call.
+  check_hits("twice", (100 + period - 1) / period);
+  check_hits("other_square", (100 + period - 1) / period);
+  check_hits("fail", 1);
+  check_hits("recover", 1);
+  check_hits("main", enable ? 0 : 1);
+  check_indices(strcmp(mode, "program") == 0);
+  check_counter(strcmp(mode, "comdat") == 0);
+
+  if(failures != 0)
+    return 1;
+
+  printf("check %s: ok\n", mode);
+  return 0;
+}
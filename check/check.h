@@ -0,0 +1,27 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Macro local variable large enough to be backed by a slab with
+// -macro-lazy-threshold=1024.
+struct check_slab
+{
+  unsigned long words[512];
+};
+
+// Called by the macro on every call to a wrapped function, before
+// macro_call(). calls is the value of a counter defined by the macro, which is
+// shared by the whole program with -macro-comdat and by each source file
+// otherwise.
+void check_enter(const char *name, const char *file, size_t index, size_t count, unsigned long calls, struct check_slab *slab);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHECK_H
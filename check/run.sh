@@ -0,0 +1,57 @@
+#!/bin/sh
+# Check the behaviour of programs the macro is applied to under various
+# options, by running check.cpp and check-other.cpp wrapped by check-macro.c.
+# Invoked by `make check` from the top level directory once libmacro.so is
+# built. Every mode is built at -O0 and -O2, and fails unless the program
+# reports the calls it made correctly.
+#
+# Environment:
+#   CHECK_CC    C compiler for the macro (default: clang)
+#   CHECK_CXX   C++ compiler for the program (default: clang++)
+#   CHECK_OUT   directory for build products (default: check/out)
+
+set -e
+
+CC=${CHECK_CC:-clang}
+CXX=${CHECK_CXX:-clang++}
+OUT=${CHECK_OUT:-check/out}
+
+PLUGIN="-fplugin=./libmacro.so -fpass-plugin=./libmacro.so"
+
+mkdir -p "$OUT"
+# Built with -fexceptions so that check.cpp can throw through the macro.
+$CC -O2 -fexceptions -c -emit-llvm -o "$OUT/check-macro.bc" check/check-macro.c
+
+failed=0
+for level in -O0 -O2; do
+  for mode in default comdat program sample enable lazy; do
+    case $mode in
+    default)
+      options= ;;
+    comdat)
+      options="-macro-comdat" ;;
+    program)
+      options="-macro-index-scope=program" ;;
+    sample)
+      options="-macro-sample-period=4" ;;
+    enable)
+      options="-macro-enable=default-off -macro-descriptors" ;;
+    lazy)
+      options="-macro-lazy-threshold=1024" ;;
+    esac
+
+    flags=
+    for option in $options; do
+      flags="$flags -mllvm $option"
+    done
+
+    program="$OUT/check$level-$mode"
+    $CXX $level -g $PLUGIN -mllvm -macro -mllvm "$OUT/check-macro.bc" $flags -o "$program" check/check.cpp check/check-other.cpp
+    if ! "$program" "$mode"; then
+      echo "check $mode: failed at $level"
+      failed=1
+    fi
+  done
+done
+
+exit $failed
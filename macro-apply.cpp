@@ -0,0 +1,209 @@
+// Standalone driver applying the macro to existing bitcode files in parallel,
+// without recompiling them from source. It is linked with macro.cpp and
+// accepts every option of the pass, e.g.
+//
+//   macro-apply -macro macro.bc -j 32 -output-dir out a.bc b.bc @more.rsp
+//
+// Every worker thread processes one input at a time, each in its own
+// LLVMContext. The content of the macro is read from disk once per process
+// and shared by all workers, but it is parsed again into the context of every
+// input. The options of the pass are only read once parsed and its statistics
+// are atomic, so both are shared safely; -time-passes is not, and is only
+// supported with -j 1.
+
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/PassManager.h>
+#include <llvm/IR/PassTimingInfo.h>
+#include <llvm/IR/Verifier.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Passes/PassPlugin.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/InitLLVM.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/Threading.h>
+#include <llvm/Support/WithColor.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace llvm;
+
+extern "C" PassPluginLibraryInfo llvmGetPassPluginInfo();
+
+static cl::list<std::string> optInputs(cl::Positional, cl::OneOrMore, cl::value_desc("bitcode files"), cl::desc("<input bitcode files or @response files>"));
+
+static cl::opt<unsigned> optJobs("j", cl::value_desc("n"), cl::desc("Number of worker threads (default: one per hardware thread)"), cl::init(0));
+
+static cl::opt<std::string> optOutputDir("output-dir", cl::value_desc("directory"), cl::desc("Write each output to the directory under the relative path of its input, instead of next to the input"));
+
+static cl::opt<std::string> optSuffix("suffix", cl::value_desc("suffix"), cl::desc("Suffix inserted before the extension of outputs written next to their input"), cl::init(".macro"));
+
+static cl::opt<std::string> optPasses("passes", cl::value_desc("pipeline"), cl::desc("Pipeline to run on every input, e.g. to optimize the result"), cl::init("macro-module-pass"));
+
+static cl::opt<bool> optVerify("verify", cl::desc("Verify every module after running the pipeline"), cl::init(true));
+
+static std::mutex errorMutex;
+
+static void reportError(StringRef filename, const Twine &message)
+{
+  std::lock_guard<std::mutex> guard(errorMutex);
+  WithColor::error(errs(), "macro-apply") << filename << ": " << message << "\n";
+}
+
+// Return the output filename for the input, or an empty string if the input is
+// outside of the current directory and would be written outside of
+// -output-dir.
+static std::string outputFilename(StringRef inputFilename)
+{
+  SmallString<256> filename;
+  if(!optOutputDir.empty())
+  {
+    SmallString<256> inputPath(inputFilename);
+    sys::path::remove_dots(inputPath, /*remove_dot_dot=*/true);
+    StringRef relativePath = sys::path::relative_path(inputPath);
+    if(relativePath.empty() || *sys::path::begin(relativePath) == "..")
+      return std::string();
+
+    filename = optOutputDir;
+    sys::path::append(filename, relativePath);
+    return std::string(filename);
+  }
+
+  filename = inputFilename;
+  std::string extension = sys::path::extension(filename).str();
+  sys::path::replace_extension(filename, optSuffix + (extension.empty() ? ".bc" : extension));
+  return std::string(filename);
+}
+
+// Apply the pipeline to a single input. Errors in the pass itself are fatal and
+// terminate the whole batch.
+static bool applyMacro(StringRef inputFilename)
+{
+  std::string filename = outputFilename(inputFilename);
+  if(filename.empty())
+  {
+    reportError(inputFilename, "input is outside of the current directory, so its output would be outside of -output-dir");
+    return false;
+  }
+
+  // Inputs are memory-mapped unless they are small.
+  ErrorOr<std::unique_ptr<MemoryBuffer>> buffer = MemoryBuffer::getFile(inputFilename, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+  if(!buffer)
+  {
+    reportError(inputFilename, buffer.getError().message());
+    return false;
+  }
+
+  LLVMContext context;
+  Expected<std::unique_ptr<Module>> module = parseBitcodeFile((*buffer)->getMemBufferRef(), context);
+  if(!module)
+  {
+    reportError(inputFilename, toString(module.takeError()));
+    return false;
+  }
+
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+
+  PassBuilder PB;
+  llvmGetPassPluginInfo().RegisterPassBuilderCallbacks(PB);
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+  ModulePassManager MPM;
+  if(Error error = PB.parsePassPipeline(MPM, optPasses))
+  {
+    reportError(inputFilename, toString(std::move(error)));
+    return false;
+  }
+
+  MPM.run(**module, MAM);
+
+  if(optVerify && verifyModule(**module, &errs()))
+  {
+    reportError(inputFilename, "invalid module after running the pipeline");
+    return false;
+  }
+
+  if(std::error_code ec = sys::fs::create_directories(sys::path::parent_path(filename)))
+  {
+    reportError(filename, ec.message());
+    return false;
+  }
+
+  std::error_code ec;
+  raw_fd_ostream stream(filename, ec, sys::fs::OF_None);
+  if(ec)
+  {
+    reportError(filename, ec.message());
+    return false;
+  }
+
+  WriteBitcodeToFile(**module, stream);
+  stream.close();
+  if(stream.has_error())
+  {
+    reportError(filename, stream.error().message());
+    stream.clear_error();
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char **argv)
+{
+  InitLLVM initLLVM(argc, argv);
+
+  // Response files given as @file are expanded by the parser.
+  cl::ParseCommandLineOptions(argc, argv, "Apply a macro to bitcode files\n");
+
+  unsigned jobs = optJobs != 0 ? optJobs.getValue() : heavyweight_hardware_concurrency().compute_thread_count();
+  jobs = std::min<size_t>(jobs, optInputs.size());
+
+  // The phase timers of every pass instance are the same global Timer, which
+  // cannot be started from several threads at once.
+  if(jobs > 1 && TimePassesIsEnabled)
+  {
+    WithColor::warning(errs(), "macro-apply") << "-time-passes is ignored with more than one job, use -j 1\n";
+    TimePassesIsEnabled = false;
+  }
+
+  // Inputs are handed out one at a time so that large modules do not hold up
+  // a whole share of the batch.
+  std::atomic<size_t> nextInput = 0;
+  std::atomic<size_t> failures = 0;
+  auto worker = [&] {
+    for(size_t i; (i = nextInput++) < optInputs.size();)
+      if(!applyMacro(optInputs[i]))
+        ++failures;
+  };
+
+  std::vector<std::thread> threads;
+  for(unsigned i=1; i<jobs; ++i)
+    threads.emplace_back(worker);
+  worker();
+
+  for(std::thread &thread: threads)
+    thread.join();
+
+  if(failures != 0)
+  {
+    WithColor::error(errs(), "macro-apply") << failures << " of " << optInputs.size() << " inputs failed\n";
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,285 @@
+// Runtime for the profiling macro in macro-profile.c, which must be linked into
+// the program (but not compiled with the macro itself). The percentiles of
+// every function are printed at exit, and on the signal whose number is given
+// by the MACRO_PROFILE_SIGNAL environment variable if any.
+
+#define _GNU_SOURCE
+
+#include "macro_profile.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+struct thread_state
+{
+  struct macro_profile_histogram *histograms;
+  struct thread_state *next;
+};
+
+uint64_t macro_profile_overhead;
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t key;
+
+static struct macro_profile_histogram *totals;
+static struct thread_state *threads;
+
+// Histograms of threads which have exited, ready to be reused by new threads,
+// so that memory is bounded by the peak number of live threads.
+static struct macro_profile_histogram *free_histograms;
+
+// Set once the histograms of the current thread are released, after which
+// calls from later thread-local destructors are no longer recorded.
+static __thread int thread_exited;
+
+static uint64_t start_timestamp;
+static uint64_t start_ns;
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void merge(struct macro_profile_histogram *to, const struct macro_profile_histogram *from)
+{
+  to->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+  to->sum += __atomic_load_n(&from->sum, __ATOMIC_RELAXED);
+  uint64_t max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+  if(max > to->max)
+    to->max = max;
+  for(size_t i=0; i<MACRO_PROFILE_BUCKETS; ++i)
+    to->buckets[i] += __atomic_load_n(&from->buckets[i], __ATOMIC_RELAXED);
+}
+
+// Return an upper bound of the given quantile, which is exact up to the
+// relative error of the histogram.
+static uint64_t quantile(const struct macro_profile_histogram *histogram, double q)
+{
+  uint64_t target = (uint64_t)(q * histogram->count);
+  if(target >= histogram->count)
+    target = histogram->count - 1;
+
+  uint64_t cumulative = 0;
+  for(size_t i=0; i<MACRO_PROFILE_BUCKETS - 1; ++i)
+  {
+    cumulative += histogram->buckets[i];
+    if(cumulative > target)
+    {
+      uint64_t value = macro_profile_bucket_value(i + 1) - 1;
+      return value < histogram->max ? value : histogram->max;
+    }
+  }
+  return histogram->max;
+}
+
+static void dump(int fd)
+{
+  // Clock units are converted to nanoseconds assuming a constant rate since
+  // the start of the program.
+  double scale = 1.0;
+  uint64_t end_timestamp = macro_clock_now();
+  uint64_t end_ns = now_ns();
+  if(end_timestamp > start_timestamp)
+    scale = (double)(end_ns - start_ns) / (double)(end_timestamp - start_timestamp);
+
+  char line[1024];
+  int length = snprintf(line, sizeof(line), "%12s %12s %12s %12s %12s %12s  %s\n", "count", "mean(ns)", "p50(ns)", "p99(ns)", "p999(ns)", "max(ns)", "function");
+  if(write(fd, line, length) != length)
+    return;
+
+  for(struct macro_profile_histogram *total = totals; total; total = total->next)
+  {
+    struct macro_profile_histogram histogram = { .name = total->name };
+    merge(&histogram, total);
+    for(struct thread_state *thread = threads; thread; thread = thread->next)
+      for(struct macro_profile_histogram *thread_histogram = thread->histograms; thread_histogram; thread_histogram = thread_histogram->next)
+        if(thread_histogram->total == total)
+          merge(&histogram, thread_histogram);
+
+    if(histogram.count == 0)
+      continue;
+
+    length = snprintf(line, sizeof(line), "%12llu %12.0f %12.0f %12.0f %12.0f %12.0f  %s\n",
+      (unsigned long long)histogram.count,
+      histogram.sum * scale / histogram.count,
+      quantile(&histogram, 0.5) * scale,
+      quantile(&histogram, 0.99) * scale,
+      quantile(&histogram, 0.999) * scale,
+      histogram.max * scale,
+      histogram.name);
+    if(length > (int)sizeof(line) - 1)
+      length = sizeof(line) - 1;
+    if(write(fd, line, length) != length)
+      return;
+  }
+}
+
+static int open_output(void)
+{
+  const char *filename = getenv("MACRO_PROFILE_FILE");
+  if(!filename)
+    return STDERR_FILENO;
+
+  return open(filename, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+}
+
+void macro_profile_dump(void)
+{
+  int fd = open_output();
+  if(fd < 0)
+    return;
+
+  pthread_mutex_lock(&mutex);
+  dump(fd);
+  pthread_mutex_unlock(&mutex);
+
+  if(fd != STDERR_FILENO)
+    close(fd);
+}
+
+// Dumping is not async-signal-safe (it formats floating point numbers and
+// opens the output file), so the signal handler only wakes up a thread which
+// dumps on its behalf.
+static sem_t dump_requests;
+
+static void *dumper(void *arg)
+{
+  (void)arg;
+
+  for(;;)
+    if(sem_wait(&dump_requests) == 0)
+      macro_profile_dump();
+  return NULL;
+}
+
+static void signal_handler(int signal)
+{
+  (void)signal;
+
+  int saved_errno = errno;
+  sem_post(&dump_requests);
+  errno = saved_errno;
+}
+
+static void thread_exit(void *value)
+{
+  struct thread_state *state = value;
+
+  pthread_mutex_lock(&mutex);
+  for(struct thread_state **link = &threads; *link; link = &(*link)->next)
+    if(*link == state)
+    {
+      *link = state->next;
+      break;
+    }
+
+  // The destructor runs on the exiting thread, so the pointers the macro keeps
+  // to the histograms in thread-local storage can still be cleared before the
+  // histograms are handed over to other threads.
+  for(struct macro_profile_histogram *histogram = state->histograms; histogram;)
+  {
+    struct macro_profile_histogram *next = histogram->next;
+    merge(histogram->total, histogram);
+    *histogram->slot = NULL;
+    memset(histogram, 0, sizeof(*histogram));
+    histogram->next = free_histograms;
+    free_histograms = histogram;
+    histogram = next;
+  }
+  thread_exited = 1;
+  pthread_mutex_unlock(&mutex);
+
+  free(state);
+}
+
+static void init(void)
+{
+  // The overhead is the cost of reading the clock twice in a row, as done
+  // around macro_call() by the macro.
+  uint64_t overhead = UINT64_MAX;
+  for(int i=0; i<1000; ++i)
+  {
+    uint64_t start = macro_clock_now();
+    uint64_t end = macro_clock_now();
+    if(end - start < overhead)
+      overhead = end - start;
+  }
+  macro_profile_overhead = overhead;
+
+  start_timestamp = macro_clock_now();
+  start_ns = now_ns();
+
+  pthread_key_create(&key, thread_exit);
+
+  const char *signal_number = getenv("MACRO_PROFILE_SIGNAL");
+  pthread_t dumper_thread;
+  if(signal_number && sem_init(&dump_requests, 0, 0) == 0 && pthread_create(&dumper_thread, NULL, dumper, NULL) == 0)
+  {
+    pthread_detach(dumper_thread);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = signal_handler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(atoi(signal_number), &action, NULL);
+  }
+
+  atexit(macro_profile_dump);
+}
+
+struct macro_profile_histogram *macro_profile_register(struct macro_profile_histogram **slot, struct macro_profile_histogram **total, const char *name)
+{
+  if(thread_exited)
+    return NULL;
+
+  pthread_once(&once, init);
+
+  pthread_mutex_lock(&mutex);
+  struct macro_profile_histogram *histogram = free_histograms;
+  if(histogram)
+    free_histograms = histogram->next;
+  else if(!(histogram = calloc(1, sizeof(*histogram))))
+    abort();
+  histogram->name = name;
+  histogram->slot = slot;
+
+  if(!*total)
+  {
+    *total = calloc(1, sizeof(**total));
+    if(!*total)
+      abort();
+    (*total)->name = name;
+    (*total)->next = totals;
+    totals = *total;
+  }
+  histogram->total = *total;
+
+  struct thread_state *state = pthread_getspecific(key);
+  if(!state)
+  {
+    state = calloc(1, sizeof(*state));
+    if(!state)
+      abort();
+    state->next = threads;
+    threads = state;
+    pthread_setspecific(key, state);
+  }
+  histogram->next = state->histograms;
+  state->histograms = histogram;
+  *slot = histogram;
+  pthread_mutex_unlock(&mutex);
+
+  return histogram;
+}
@@ -0,0 +1,19 @@
+#include "macro.h"
+#include "macro_profile.h"
+
+// Record the latency of every call to the functions the macro is expanded
+// into. The histogram of each function is allocated on its first call in
+// every thread, and its total on its first call overall. Calls made while the
+// thread exits, once its histograms are released, are not recorded.
+void macro_def(void)
+{
+  struct macro_profile_histogram **slot = &macro_local_tls(struct macro_profile_histogram *);
+  struct macro_profile_histogram *histogram = *slot;
+  if(__builtin_expect(!histogram, 0))
+    histogram = macro_profile_register(slot, &macro_local(struct macro_profile_histogram *), macro_function_name());
+
+  uint64_t start = macro_clock_now();
+  macro_call();
+  if(__builtin_expect(histogram != NULL, 1))
+    macro_profile_record(histogram, start, macro_clock_now());
+}
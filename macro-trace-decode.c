@@ -0,0 +1,100 @@
+// Convert a trace written by macro-trace-runtime.c into the Chrome trace event
+// format (as loaded by chrome://tracing or https://ui.perfetto.dev).
+//
+// Usage: macro-trace-decode [trace file] > trace.json
+
+#include "macro_trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void print_json_string(const char *string)
+{
+  putchar('"');
+  for(const unsigned char *c = (const unsigned char *)string; *c; ++c)
+    if(*c == '"' || *c == '\\')
+      printf("\\%c", *c);
+    else if(*c < 0x20)
+      printf("\\u%04x", *c);
+    else
+      putchar(*c);
+  putchar('"');
+}
+
+int main(int argc, char **argv)
+{
+  const char *filename = argc > 1 ? argv[1] : "macro-trace.bin";
+
+  FILE *file = fopen(filename, "rb");
+  if(!file)
+  {
+    perror(filename);
+    return 1;
+  }
+
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  char *data = malloc(size + 1);
+  if(!data || fread(data, 1, size, file) != (size_t)size)
+  {
+    fprintf(stderr, "%s: failed to read trace\n", filename);
+    return 1;
+  }
+  data[size] = '\0';
+  fclose(file);
+
+  struct macro_trace_header header;
+  if((size_t)size < sizeof(header) || memcmp(data, MACRO_TRACE_MAGIC, sizeof(header.magic)) != 0)
+  {
+    fprintf(stderr, "%s: not a trace\n", filename);
+    return 1;
+  }
+  memcpy(&header, data, sizeof(header));
+
+  const struct macro_trace_event *events = (const struct macro_trace_event *)(data + sizeof(header));
+  const char *names = (const char *)(events + header.event_count);
+  if(header.event_count > (size - sizeof(header)) / sizeof(struct macro_trace_event))
+  {
+    fprintf(stderr, "%s: truncated trace\n", filename);
+    return 1;
+  }
+
+  const char **name_table = calloc(header.name_count + 1, sizeof(const char *));
+  for(uint64_t i=0; i<header.name_count && names < data + size; ++i)
+  {
+    name_table[i] = names;
+    names += strlen(names) + 1;
+  }
+
+  if(header.dropped_count != 0)
+    fprintf(stderr, "%s: %llu events were dropped\n", filename, (unsigned long long)header.dropped_count);
+
+  // Timestamps are converted to microseconds assuming a constant rate between
+  // the start and the end of the trace.
+  double scale = 1.0;
+  if(header.end_timestamp > header.start_timestamp)
+    scale = (double)(header.end_ns - header.start_ns) / (double)(header.end_timestamp - header.start_timestamp);
+
+  printf("{\"traceEvents\":[\n");
+  for(uint64_t i=0; i<header.event_count; ++i)
+  {
+    const struct macro_trace_event *event = &events[i];
+    uint32_t index = event->index & 0x7fffffff;
+    double ts = (double)(event->timestamp - header.start_timestamp) * scale / 1000.0;
+
+    printf("{\"name\":");
+    if(index < header.name_count && name_table[index])
+      print_json_string(name_table[index]);
+    else
+      printf("\"#%u\"", index);
+    printf(",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":0,\"tid\":%u}%s\n", event->index >> 31 ? 'E' : 'B', ts, event->thread, i + 1 == header.event_count ? "" : ",");
+  }
+  printf("]}\n");
+
+  free(name_table);
+  free(data);
+  return 0;
+}
@@ -0,0 +1,234 @@
+// Runtime for the tracing macro in macro-trace.c, which must be linked into
+// the program (but not compiled with the macro itself). The trace is written
+// to the file named by the MACRO_TRACE_FILE environment variable, or to
+// macro-trace.bin by default, in the format described in macro_trace.h.
+
+#define _GNU_SOURCE
+
+#include "macro_runtime.h"
+#include "macro_trace.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// The file is mapped through a sliding window of this size.
+#define WINDOW_SIZE (16u << 20)
+
+__thread struct macro_trace_buffer *macro_trace_thread_buffer __attribute__((tls_model("initial-exec")));
+
+// Buffer left to threads once they have exited, which is always full so that
+// events recorded by later thread-local destructors are simply dropped.
+static struct macro_trace_buffer exited_buffer = { .head = MACRO_TRACE_BUFFER_SIZE };
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t key;
+static pthread_t drainer;
+static int running;
+
+static struct macro_trace_buffer *buffers;
+static uint64_t dropped;
+
+static int fd = -1;
+static struct macro_trace_header header;
+static char *window;
+static uint64_t window_offset;
+static uint64_t position;
+static int failed;
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void write_bytes(const void *data, size_t size)
+{
+  const char *bytes = data;
+  while(size != 0 && !failed)
+  {
+    if(!window || position >= window_offset + WINDOW_SIZE)
+    {
+      if(window)
+        munmap(window, WINDOW_SIZE);
+
+      window_offset = position & ~(uint64_t)(sysconf(_SC_PAGESIZE) - 1);
+      window = NULL;
+      void *mapping = MAP_FAILED;
+      if(ftruncate(fd, window_offset + WINDOW_SIZE) == 0)
+        mapping = mmap(NULL, WINDOW_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, window_offset);
+
+      if(mapping == MAP_FAILED)
+      {
+        perror("macro-trace: failed to map trace file");
+        failed = 1;
+        return;
+      }
+
+      window = mapping;
+    }
+
+    size_t chunk = window_offset + WINDOW_SIZE - position;
+    if(chunk > size)
+      chunk = size;
+
+    memcpy(window + (position - window_offset), bytes, chunk);
+    position += chunk;
+    bytes += chunk;
+    size -= chunk;
+  }
+}
+
+static uint64_t drain(struct macro_trace_buffer *buffer)
+{
+  uint64_t head = __atomic_load_n(&buffer->head, __ATOMIC_ACQUIRE);
+  uint64_t tail = buffer->tail;
+  if(head == tail)
+    return 0;
+
+  // Copy the events up to the end of the ring first if they wrap around.
+  uint64_t begin = tail & (MACRO_TRACE_BUFFER_SIZE - 1);
+  uint64_t count = head - tail;
+  uint64_t first = MACRO_TRACE_BUFFER_SIZE - begin < count ? MACRO_TRACE_BUFFER_SIZE - begin : count;
+  write_bytes(&buffer->events[begin], first * sizeof(struct macro_trace_event));
+  write_bytes(&buffer->events[0], (count - first) * sizeof(struct macro_trace_event));
+  header.event_count += count;
+
+  __atomic_store_n(&buffer->tail, head, __ATOMIC_RELEASE);
+  return count;
+}
+
+// Drain every buffer, and free those of threads which have exited once they
+// are empty. Must be called with the mutex held.
+static uint64_t drain_all(void)
+{
+  uint64_t count = 0;
+  for(struct macro_trace_buffer **link = &buffers; *link;)
+  {
+    struct macro_trace_buffer *buffer = *link;
+    int retired = __atomic_load_n(&buffer->retired, __ATOMIC_ACQUIRE);
+    count += drain(buffer);
+    if(retired)
+    {
+      dropped += __atomic_load_n(&buffer->dropped, __ATOMIC_RELAXED);
+      *link = buffer->next;
+      free(buffer);
+    }
+    else
+      link = &buffer->next;
+  }
+  return count;
+}
+
+static void *drainer_main(void *arg)
+{
+  (void)arg;
+
+  // Keep draining without sleeping for as long as events keep coming.
+  struct timespec period = { .tv_sec = 0, .tv_nsec = 1000000 };
+  while(__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+  {
+    pthread_mutex_lock(&mutex);
+    uint64_t count = drain_all();
+    pthread_mutex_unlock(&mutex);
+    if(count < MACRO_TRACE_BUFFER_SIZE / 4)
+      nanosleep(&period, NULL);
+  }
+  return NULL;
+}
+
+static void thread_exit(void *value)
+{
+  struct macro_trace_buffer *buffer = value;
+  macro_trace_thread_buffer = &exited_buffer;
+  __atomic_store_n(&buffer->retired, 1, __ATOMIC_RELEASE);
+}
+
+static void finish(void)
+{
+  __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+  pthread_join(drainer, NULL);
+
+  pthread_mutex_lock(&mutex);
+  drain_all();
+  for(struct macro_trace_buffer *buffer = buffers; buffer; buffer = buffer->next)
+    dropped += __atomic_load_n(&buffer->dropped, __ATOMIC_RELAXED);
+  dropped += __atomic_load_n(&exited_buffer.dropped, __ATOMIC_RELAXED);
+
+  // Names are only available if descriptors are emitted, and match
+  // macro_index() only with -macro-index-scope=program.
+  header.name_count = macro_descriptor_count();
+  for(size_t i=0; i<header.name_count; ++i)
+  {
+    const char *name = macro_descriptor_at(i)->name;
+    write_bytes(name, strlen(name) + 1);
+  }
+
+  header.dropped_count = dropped;
+  header.end_timestamp = macro_clock_now();
+  header.end_ns = now_ns();
+
+  if(window)
+    munmap(window, WINDOW_SIZE);
+  if(failed || ftruncate(fd, position) != 0 || pwrite(fd, &header, sizeof(header), 0) != sizeof(header))
+    fprintf(stderr, "macro-trace: failed to write trace\n");
+  close(fd);
+  pthread_mutex_unlock(&mutex);
+}
+
+static void init(void)
+{
+  const char *filename = getenv("MACRO_TRACE_FILE");
+  if(!filename)
+    filename = "macro-trace.bin";
+
+  fd = open(filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if(fd < 0)
+  {
+    perror("macro-trace: failed to open trace file");
+    abort();
+  }
+
+  memcpy(header.magic, MACRO_TRACE_MAGIC, sizeof(header.magic));
+  header.start_timestamp = macro_clock_now();
+  header.start_ns = now_ns();
+  position = sizeof(header);
+
+  pthread_key_create(&key, thread_exit);
+
+  running = 1;
+  if(pthread_create(&drainer, NULL, drainer_main, NULL) != 0)
+  {
+    fprintf(stderr, "macro-trace: failed to start drainer\n");
+    abort();
+  }
+  atexit(finish);
+}
+
+struct macro_trace_buffer *macro_trace_thread_init(void)
+{
+  pthread_once(&once, init);
+
+  struct macro_trace_buffer *buffer;
+  if(posix_memalign((void **)&buffer, 64, sizeof(*buffer)) != 0)
+    return macro_trace_thread_buffer = &exited_buffer;
+
+  memset(buffer, 0, offsetof(struct macro_trace_buffer, events));
+  buffer->thread = syscall(SYS_gettid);
+
+  pthread_mutex_lock(&mutex);
+  buffer->next = buffers;
+  buffers = buffer;
+  pthread_mutex_unlock(&mutex);
+
+  pthread_setspecific(key, buffer);
+  return macro_trace_thread_buffer = buffer;
+}
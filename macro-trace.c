@@ -0,0 +1,12 @@
+#include "macro.h"
+#include "macro_trace.h"
+
+// Record the entry and the exit of every function the macro is expanded into.
+// Exits by unwinding (or longjmp()) are not recorded.
+void macro_def(void)
+{
+  size_t index = macro_index();
+  macro_trace_emit(index, MACRO_TRACE_ENTRY);
+  macro_call();
+  macro_trace_emit(index, MACRO_TRACE_EXIT);
+}
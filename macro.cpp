@@ -1,40 +1,284 @@
 #include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/Statistic.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Analysis/InlineCost.h>
+#include <llvm/Analysis/LoopInfo.h>
+#include <llvm/Analysis/ProfileSummaryInfo.h>
+#include <llvm/Analysis/ScalarEvolution.h>
+#include <llvm/Demangle/Demangle.h>
+#include <llvm/IR/ConstantRange.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/DebugInfoMetadata.h>
+#include <llvm/IR/Dominators.h>
 #include <llvm/IR/Function.h>
+#include <llvm/IR/InstIterator.h>
+#include <llvm/IR/MDBuilder.h>
 #include <llvm/IR/Module.h>
 #include <llvm/IR/PassManager.h>
+#include <llvm/IR/PassTimingInfo.h>
+#include <llvm/IR/PatternMatch.h>
 #include <llvm/IRReader/IRReader.h>
 #include <llvm/Linker/Linker.h>
 #include <llvm/Passes/PassBuilder.h>
 #include <llvm/Passes/PassPlugin.h>
 #include <llvm/Support/CommandLine.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/MD5.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/Regex.h>
+#include <llvm/Support/Timer.h>
+#include <llvm/Support/xxhash.h>
+#include <llvm/TargetParser/Triple.h>
+#include <llvm/Transforms/InstCombine/InstCombine.h>
+#include <llvm/Transforms/Scalar/SROA.h>
+#include <llvm/Transforms/Scalar/SimplifyCFG.h>
 #include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Transforms/Utils/CodeExtractor.h>
+#include <llvm/Transforms/Utils/LoopUtils.h>
+#include <llvm/Transforms/Utils/ModuleUtils.h>
+
+#include <memory>
+#include <mutex>
 
 using namespace llvm;
 
+#define DEBUG_TYPE "macro"
+
+STATISTIC(NumFunctionsWrapped, "Number of functions the macro is expanded into");
+STATISTIC(NumFunctionsSkipped, "Number of defined functions the macro is not expanded into");
+STATISTIC(NumHotFunctions, "Number of defined functions which are hot according to the profile");
+STATISTIC(NumCallSitesWrapped, "Number of call sites the macro is expanded around");
+STATISTIC(NumLoopsWrapped, "Number of loops the macro is expanded around");
+STATISTIC(NumMacroFunctionsCloned, "Number of macro functions cloned");
+STATISTIC(NumMacroFunctionsSpecialized, "Number of macro function specializations");
+STATISTIC(NumExpansionsInlined, "Number of expansions with the macro inlined");
+STATISTIC(NumColdRegionsOutlined, "Number of macro_unlikely() regions outlined into cold functions");
+STATISTIC(NumStorageIds, "Number of macro_array() and macro local variable ids");
+STATISTIC(NumStorageBytes, "Number of bytes of storage allocated for macro_array() and macro local variables");
+STATISTIC(NumInstructionsBefore, "Number of instructions of wrapped functions before expansion");
+STATISTIC(NumInstructionsAfter, "Number of instructions of wrapped functions, lambdas and specializations after expansion");
+
 struct MacroFilename
 {
 public:
-  static inline std::optional<std::string> opt_value;
+  static inline std::vector<std::string> opt_values;
 
-  static const std::string &get()
+  static ArrayRef<std::string> get()
   {
-    if(!opt_value)
+    if(opt_values.empty())
       report_fatal_error("missing -macro <macrofilename> argument (pass -mllvm -macro <macrofilename> if invoked via clang)", false);
 
-    return *opt_value;
+    return opt_values;
   }
 
 public:
   void operator=(const std::string &filename)
   {
-    if(opt_value)
-      report_fatal_error("too many -macro <macrofilename> arguments passed", false);
+    opt_values.push_back(filename);
+  }
+};
+
+// May be given multiple times to compose several macros, from the outermost to
+// the innermost one.
+static cl::opt<MacroFilename, false, cl::parser<std::string>> optMacroFilename("macro", cl::ZeroOrMore, cl::value_desc("macrofilename"), cl::desc("Load the specified macro (may be given multiple times)"));
+
+// The content of macro modules is read from disk at most once per process (for
+// as long as the file is left unmodified) and then lazily parsed into the
+// context of every module the macro is applied to.
+class MacroModuleCache
+{
+public:
+  struct Entry
+  {
+    sys::TimePoint<> modificationTime;
+    uint64_t size;
+    uint64_t hash;
+    std::unique_ptr<MemoryBuffer> buffer;
+  };
 
-    opt_value = filename;
+  static std::shared_ptr<const Entry> get(const std::string &filename)
+  {
+    std::lock_guard<std::mutex> guard(mutex);
+
+    sys::fs::file_status status;
+    if(std::error_code ec = sys::fs::status(filename, status))
+      report_fatal_error("failed to load macro module:" + Twine(filename) + ": " + ec.message(), false);
+
+    std::shared_ptr<const Entry> &entry = entries[filename];
+    if(entry && entry->modificationTime == status.getLastModificationTime() && entry->size == status.getSize())
+      return entry;
+
+    ErrorOr<std::unique_ptr<MemoryBuffer>> buffer = MemoryBuffer::getFile(filename);
+    if(!buffer)
+      report_fatal_error("failed to load macro module:" + Twine(filename) + ": " + buffer.getError().message(), false);
+
+    uint64_t hash = xxHash64((*buffer)->getBuffer());
+    entry = std::make_shared<const Entry>(Entry{
+      .modificationTime = status.getLastModificationTime(),
+      .size = status.getSize(),
+      .hash = hash,
+      .buffer = std::move(*buffer),
+    });
+    return entry;
   }
+
+private:
+  static inline std::mutex mutex;
+  static inline StringMap<std::shared_ptr<const Entry>> entries;
+};
+
+enum class SpecializeMode
+{
+  Always,
+  Small,
+  Never,
+};
+
+static cl::opt<SpecializeMode> optSpecialize("macro-specialize", cl::desc("Clone the macro for every wrapped function with the lambda and index bound as constants"), cl::init(SpecializeMode::Never),
+  cl::values(
+    clEnumValN(SpecializeMode::Always, "always", "Specialize the macro for every wrapped function"),
+    clEnumValN(SpecializeMode::Small, "small", "Specialize the macro only if it is smaller than -macro-specialize-threshold"),
+    clEnumValN(SpecializeMode::Never, "never", "Share a single copy of the macro between all wrapped functions")
+  )
+);
+
+static cl::opt<unsigned> optSpecializeThreshold("macro-specialize-threshold", cl::desc("Maximum number of instructions in the macro for -macro-specialize=small"), cl::init(128));
+
+enum class Lowering
+{
+  Auto,
+  Split,
+};
+
+static cl::opt<Lowering> optLowering("macro-lowering", cl::desc("How the macro is expanded into a function"), cl::init(Lowering::Auto),
+  cl::values(
+    clEnumValN(Lowering::Auto, "auto", "Inline the macro and the original function into the trampoline if the macro calls macro_call() exactly once outside of any loop"),
+    clEnumValN(Lowering::Split, "split", "Always split the function into a lambda and a trampoline")
+  )
+);
+
+enum class ExtensionPoint
+{
+  Start,
+  OptimizerEarly,
+  OptimizerLast,
+  FullLTOLast,
+  ThinLTOPreLink,
+};
+
+static cl::opt<ExtensionPoint> optExtensionPoint("macro-ep", cl::desc("Where in the optimization pipeline the macro is applied"), cl::init(ExtensionPoint::Start),
+  cl::values(
+    clEnumValN(ExtensionPoint::Start, "start", "At the start of the pipeline, before any inlining"),
+    clEnumValN(ExtensionPoint::OptimizerEarly, "optimizer-early", "At the start of the optimizer, after inlining"),
+    clEnumValN(ExtensionPoint::OptimizerLast, "optimizer-last", "At the end of the optimizer"),
+    clEnumValN(ExtensionPoint::FullLTOLast, "full-lto-last", "At the end of the full LTO link time pipeline"),
+    clEnumValN(ExtensionPoint::ThinLTOPreLink, "thin-lto-pre-link", "Alias of optimizer-last, which the ThinLTO pre-link pipeline runs right before the summary is built")
+  )
+);
+
+static cl::opt<bool> optNoInline("macro-noinline", cl::desc("Mark functions the macro is expanded into as noinline"), cl::init(false));
+
+enum class IndexScope
+{
+  Module,
+  Program,
+};
+
+static cl::opt<IndexScope> optIndexScope("macro-index-scope", cl::desc("Scope over which macro_index() is allocated and macro_count() and macro_array() are defined"), cl::init(IndexScope::Module),
+  cl::values(
+    clEnumValN(IndexScope::Module, "module", "Allocate indices separately in each module"),
+    clEnumValN(IndexScope::Program, "program", "Allocate indices over the whole program (or shared library) at link time")
+  )
+);
+
+enum class LocalLayout
+{
+  SoA,
+  AoS,
+};
+
+static cl::opt<LocalLayout> optLocalLayout("macro-local-layout", cl::desc("Memory layout of macro local variables"), cl::init(LocalLayout::SoA),
+  cl::values(
+    clEnumValN(LocalLayout::SoA, "soa", "Allocate a separate array for every macro local variable"),
+    clEnumValN(LocalLayout::AoS, "aos", "Pack all macro local variables of a function into one cache line aligned record")
+  )
+);
+
+static cl::opt<uint64_t> optLazyThreshold("macro-lazy-threshold", cl::value_desc("bytes"), cl::desc("Back static macro local variables of at least this size with a slab per function allocated on first use instead of static storage (0 to disable)"), cl::init(0));
+
+static cl::opt<unsigned> optPercpuShards("macro-percpu-shards", cl::desc("Number of shards of per-CPU macro local variables (must be a power of 2)"), cl::init(64));
+
+static cl::opt<unsigned> optSamplePeriod("macro-sample-period", cl::desc("Only run the macro on every Nth call of each function in each thread"), cl::init(1));
+static cl::opt<bool> optSampleJitter("macro-sample-jitter", cl::desc("Randomize the sample period to avoid aliasing with periodic behaviours"), cl::init(false));
+
+enum class EnableMode
+{
+  Always,
+  DefaultOn,
+  DefaultOff,
+};
+
+static cl::opt<EnableMode> optEnable("macro-enable", cl::desc("Whether the macro can be enabled and disabled for each function at run time"), cl::init(EnableMode::Always),
+  cl::values(
+    clEnumValN(EnableMode::Always, "always", "Always run the macro"),
+    clEnumValN(EnableMode::DefaultOn, "default-on", "Guard the macro with a flag per function which is initially set"),
+    clEnumValN(EnableMode::DefaultOff, "default-off", "Guard the macro with a flag per function which is initially clear")
+  )
+);
+
+static cl::opt<bool> optDescriptors("macro-descriptors", cl::desc("Always emit the descriptors of wrapped functions and call sites, even if the macro does not use them"), cl::init(false));
+
+static cl::opt<bool> optComdat("macro-comdat", cl::desc("Emit macro functions which do not depend on per-module state as linkonce_odr in COMDAT groups so that the linker can deduplicate them"), cl::init(false));
+
+static cl::list<std::string> optInclude("macro-include", cl::value_desc("regex"), cl::desc("Only expand the macro into functions whose mangled or demangled name matches the regex"));
+static cl::list<std::string> optExclude("macro-exclude", cl::value_desc("regex"), cl::desc("Do not expand the macro into functions whose mangled or demangled name matches the regex"));
+static cl::opt<unsigned> optMinInstructions("macro-min-instructions", cl::desc("Do not expand the macro into functions with fewer instructions"), cl::init(0));
+static cl::opt<unsigned> optMinBlocks("macro-min-blocks", cl::desc("Do not expand the macro into functions with fewer basic blocks"), cl::init(0));
+
+static cl::list<std::string> optCallSite("macro-callsite", cl::value_desc("regex"), cl::desc("Expand macro_def_callsite() around calls to functions whose mangled or demangled name matches the regex"));
+static cl::opt<unsigned> optLoopDepth("macro-loop-depth", cl::desc("Expand macro_def_loop() around loops nested at most this deep (1 for top-level loops only)"), cl::init(1));
+static cl::opt<unsigned> optLoopMinTripCount("macro-loop-min-trip-count", cl::desc("Only expand macro_def_loop() around loops whose trip count is known or estimated from the profile to be at least this large"), cl::init(0));
+
+enum class HotPolicy
+{
+  Full,
+  Skip,
+  Sample,
+  Lightweight,
 };
 
-static cl::opt<MacroFilename, false, cl::parser<std::string>> optMacroFilename("macro", cl::value_desc("macrofilename"), cl::desc("Load the specified macro"));
+static cl::opt<HotPolicy> optHotPolicy("macro-hot-policy", cl::desc("How the macro is expanded into functions which are hot according to the profile (PGO or sample profile) of the module"), cl::init(HotPolicy::Full),
+  cl::values(
+    clEnumValN(HotPolicy::Full, "full", "Expand macro_def() into hot functions like into any other function"),
+    clEnumValN(HotPolicy::Skip, "skip", "Do not expand the macro into hot functions"),
+    clEnumValN(HotPolicy::Sample, "sample", "Only run the macro on every Nth call of hot functions, given by -macro-hot-sample-period"),
+    clEnumValN(HotPolicy::Lightweight, "lightweight", "Expand macro_def_hot() into hot functions instead of macro_def()")
+  )
+);
+
+static cl::opt<unsigned> optHotPercentile("macro-hot-percentile", cl::desc("Functions whose entry count is within the given percentile of the profile (in parts per million) are hot"), cl::init(990000));
+static cl::opt<unsigned> optHotSamplePeriod("macro-hot-sample-period", cl::desc("Sample period of hot functions with -macro-hot-policy=sample"), cl::init(100));
+
+static cl::opt<bool> optOutlineCold("macro-outline-cold", cl::desc("Outline the regions of the macro guarded by macro_unlikely() into cold functions"), cl::init(true));
+
+static cl::opt<std::string> optReport("macro-report", cl::value_desc("filename"), cl::desc("Append a line of JSON describing the expansion of the macro into each module to the file"));
+
+// Return the symbol defined by the linker at the start or the end of a section,
+// which requires the section name to be a valid C identifier. The symbols are
+// hidden so that every shared library refers to its own section.
+static GlobalVariable *sectionBoundary(Module &module, StringRef section, bool end)
+{
+  std::string name = ((end ? "__stop_" : "__start_") + section).str();
+  if(GlobalVariable *globalVariable = module.getGlobalVariable(name))
+    return globalVariable;
+
+  ArrayType *type = ArrayType::get(Type::getInt8Ty(module.getContext()), 0);
+  GlobalVariable *globalVariable = new GlobalVariable(module, type, false, GlobalValue::ExternalLinkage, nullptr, name);
+  globalVariable->setVisibility(GlobalValue::HiddenVisibility);
+  return globalVariable;
+}
 
 static bool functionIsDefined(Function& f)
 {
@@ -58,6 +302,576 @@ static bool functionCheckSignature(Function& f, Type *RetTy, ArrayRef<Type *> Pa
   return true;
 }
 
+// Materialize only the part of a lazily loaded macro module which is reachable
+// from the given roots. Every other function is turned into a declaration so
+// that neither the bitcode reader nor the linker has to process its body. The
+// linker still links every global variable and alias, so functions referenced
+// by them (e.g. from dispatch tables) are reachable as well, or they would end
+// up as undefined external symbols.
+static void materializeReachable(Module &module, ArrayRef<GlobalValue *> roots)
+{
+  SmallPtrSet<Value *, 32> visited;
+  SmallVector<Value *> worklist(roots.begin(), roots.end());
+
+  for(GlobalVariable &globalVariable: module.globals())
+    if(!globalVariable.isDeclaration())
+      worklist.push_back(&globalVariable);
+
+  for(GlobalAlias &globalAlias: module.aliases())
+    worklist.push_back(&globalAlias);
+
+  while(!worklist.empty())
+  {
+    Value *value = worklist.pop_back_val();
+    if(!visited.insert(value).second)
+      continue;
+
+    if(Function *function = dyn_cast<Function>(value))
+    {
+      if(Error error = function->materialize())
+        report_fatal_error(std::move(error), false);
+
+      for(BasicBlock &block : *function)
+        for(Instruction &instr : block)
+          for(Value *operand: instr.operands())
+            if(isa<Constant>(operand))
+              worklist.push_back(operand);
+
+      if(function->hasPersonalityFn())
+        worklist.push_back(function->getPersonalityFn());
+    }
+    else if(GlobalVariable *globalVariable = dyn_cast<GlobalVariable>(value))
+    {
+      if(globalVariable->hasInitializer())
+        worklist.push_back(globalVariable->getInitializer());
+    }
+    else if(GlobalAlias *globalAlias = dyn_cast<GlobalAlias>(value))
+      worklist.push_back(globalAlias->getAliasee());
+    else if(Constant *constant = dyn_cast<Constant>(value))
+      for(Value *operand: constant->operands())
+        worklist.push_back(operand);
+  }
+
+  for(Function &function: module)
+    if(function.isMaterializable())
+      function.deleteBody();
+}
+
+// Prepare the macro at the given position in the list of composed macros to be
+// linked together with the other ones. Its entry point is renamed so that the
+// previous macro calls it in place of macro_call(), its own macro_call() is
+// renamed to the entry point of the next macro, and the ids passed to storage
+// builtins are tagged with its position so that they do not collide.
+static void composeMacroModule(Module &module, size_t position, size_t count, StringRef &entryName, const Twine &filename)
+{
+  Function *entry = nullptr;
+  for(StringRef name: {"macro_def", "macro_def_callsite", "macro_def_loop"})
+    if(Function *function = module.getFunction(name); function && functionIsDefined(*function))
+    {
+      if(entry)
+        report_fatal_error("composed macro " + filename + " must define exactly one of macro_def, macro_def_callsite or macro_def_loop", false);
+      entry = function;
+    }
+
+  if(!entry)
+    report_fatal_error("missing definition of void macro_def(void), void macro_def_callsite(void) or void macro_def_loop(void) in composed macro " + filename, false);
+
+  if(Function *function = module.getFunction("macro_def_hot"); function && functionIsDefined(*function))
+    report_fatal_error("macro_def_hot is not supported in composed macro " + filename, false);
+
+  if(position == 0)
+    entryName = entry->getName();
+  else if(entry->getName() != entryName)
+    report_fatal_error("composed macro " + filename + " must define " + entryName + " like the first macro", false);
+
+  if(!functionCheckSignature(*entry, Type::getVoidTy(module.getContext()), {}))
+    report_fatal_error("invalid definition of " + entryName + " in composed macro " + filename + ": " + entryName + " must have the following signature (without name mangling): void " + entryName + "(void)", false);
+
+  // Other definitions end up with internal linkage in the main module anyway,
+  // but must not clash with those of the other macros in the meantime.
+  // Global variables are left as is with -macro-comdat, which shares them by
+  // name between modules.
+  for(GlobalValue &value: module.global_values())
+    if(&value != entry && !value.isDeclaration() && value.hasExternalLinkage() && (isa<Function>(value) || !optComdat))
+      value.setLinkage(GlobalValue::InternalLinkage);
+
+  if(position != 0)
+    entry->setName("macro.compose." + utostr(position));
+
+  if(Function *macroCall = module.getFunction("macro_call"); macroCall && position + 1 != count)
+    macroCall->setName("macro.compose." + utostr(position + 1));
+
+  for(StringRef name: {"macro_array", "macro_local_ptr", "macro_tls_array", "macro_local_tls_ptr", "macro_local_percpu_ptr", "macro_local_percpu_shard_ptr"})
+    if(Function *function = module.getFunction(name))
+      for(User *user: function->users())
+        if(CallInst *callInstr = dyn_cast<CallInst>(user); callInstr && callInstr->getCalledOperand() == function && callInstr->arg_size() != 0)
+          if(ConstantInt *id = dyn_cast<ConstantInt>(callInstr->getArgOperand(0)))
+          {
+            // The tag goes into the top 8 bits of size_t.
+            unsigned shift = id->getBitWidth() - 8;
+            if(id->getValue().getActiveBits() > shift)
+              report_fatal_error("id argument passed to " + name + " in composed macro " + filename + " must be less than 2^" + Twine(shift), false);
+
+            callInstr->setArgOperand(0, ConstantInt::get(id->getType(), id->getZExtValue() | (uint64_t(position) << shift)));
+          }
+}
+
+static void collectReachableFunctions(Function *root, const SmallPtrSetImpl<Function *> &within, SmallPtrSetImpl<Function *> &reachable)
+{
+  if(!reachable.insert(root).second)
+    return;
+
+  for(BasicBlock &block : *root)
+    for(Instruction &instr : block)
+      if(CallInst *callInstr = dyn_cast<CallInst>(&instr))
+        if(Function *calledFunction = callInstr->getCalledFunction(); calledFunction && within.contains(calledFunction))
+          collectReachableFunctions(calledFunction, within, reachable);
+}
+
+// The lambda runs code of the original function, so it inherits its function
+// attributes (e.g. target features, nounwind or optsize), except for the memory
+// effects since it accesses the lambda context, attributes which refer to the
+// signature of the original function such as allocsize, and inlining attributes
+// which only make sense for the original function. noinline is kept along with
+// optnone, which requires it (e.g. for every function at -O0).
+static void copyLambdaAttributes(const Function &function, Function *lambdaFunction)
+{
+  AttrBuilder lambdaAttrs(function.getContext(), function.getAttributes().getFnAttrs());
+  lambdaAttrs.removeAttribute(Attribute::Memory);
+  lambdaAttrs.removeAttribute(Attribute::AllocSize);
+  lambdaAttrs.removeAttribute(Attribute::AllocKind);
+  lambdaAttrs.removeAttribute("alloc-family");
+  lambdaAttrs.removeAttribute(Attribute::InlineHint);
+  if(!lambdaAttrs.contains(Attribute::OptimizeNone))
+    lambdaAttrs.removeAttribute(Attribute::NoInline);
+  lambdaFunction->addFnAttrs(lambdaAttrs);
+}
+
+// The lambda of a call site or loop only runs the call, so it does not inherit
+// the attributes describing the body of the caller (e.g. noreturn or optnone),
+// only those describing the target and the ABI. It is nounwind if the call is.
+static void copyCallSiteLambdaAttributes(const CallBase &callInstr, Function *lambdaFunction)
+{
+  const Function &caller = *callInstr.getFunction();
+  AttrBuilder lambdaAttrs(caller.getContext());
+  for(StringRef kind: {"target-cpu", "target-features", "tune-cpu", "frame-pointer"})
+    if(Attribute attr = caller.getFnAttribute(kind); attr.isValid())
+      lambdaAttrs.addAttribute(attr);
+  if(Attribute attr = caller.getFnAttribute(Attribute::UWTable); attr.isValid())
+    lambdaAttrs.addAttribute(attr);
+  if(callInstr.doesNotThrow())
+    lambdaAttrs.addAttribute(Attribute::NoUnwind);
+  lambdaFunction->addFnAttrs(lambdaAttrs);
+}
+
+// With a late -macro-ep, FunctionAttrs may already have inferred attributes
+// from the original body which no longer hold once the function calls the
+// macro, e.g. memory(none) or willreturn would let later passes delete calls
+// whose result is unused along with the instrumentation. They are dropped from
+// the function and from the calls to it.
+static void dropInferredAttributes(Function &function)
+{
+  AttributeMask inferredAttrs;
+  inferredAttrs.addAttribute(Attribute::Memory);
+  inferredAttrs.addAttribute(Attribute::WillReturn);
+  inferredAttrs.addAttribute(Attribute::NoSync);
+  inferredAttrs.addAttribute(Attribute::NoFree);
+  inferredAttrs.addAttribute(Attribute::NoRecurse);
+  inferredAttrs.addAttribute(Attribute::Speculatable);
+
+  function.removeFnAttrs(inferredAttrs);
+  for(User *user: function.users())
+    if(CallBase *callInstr = dyn_cast<CallBase>(user); callInstr && callInstr->getCalledOperand() == &function)
+      callInstr->removeFnAttrs(inferredAttrs);
+}
+
+// Attach the attributes of an argument of the original function to the load of
+// its value from the lambda context as metadata, so that the body of the
+// lambda can still rely on them.
+static void annotateArgumentLoad(const Argument &argument, LoadInst *loadInstr)
+{
+  LLVMContext &context = loadInstr->getContext();
+  const DataLayout &dataLayout = loadInstr->getModule()->getDataLayout();
+  Type *int64Type = Type::getInt64Ty(context);
+
+  if(argument.hasAttribute(Attribute::NoUndef))
+    loadInstr->setMetadata(LLVMContext::MD_noundef, MDNode::get(context, {}));
+
+  if(argument.getType()->isPointerTy())
+  {
+    if(argument.hasAttribute(Attribute::NonNull))
+      loadInstr->setMetadata(LLVMContext::MD_nonnull, MDNode::get(context, {}));
+
+    if(MaybeAlign alignment = argument.getParamAlign())
+      loadInstr->setMetadata(LLVMContext::MD_align, MDNode::get(context, ConstantAsMetadata::get(ConstantInt::get(int64Type, alignment->value()))));
+
+    // The trampoline passes on the pointer to the copy made by the caller
+    // rather than copying byval arguments again, which is only valid for the
+    // size of the type.
+    uint64_t dereferenceableBytes = argument.getDereferenceableBytes();
+    if(Type *byValType = argument.getParamByValType())
+      dereferenceableBytes = std::max<uint64_t>(dereferenceableBytes, dataLayout.getTypeAllocSize(byValType).getFixedValue());
+
+    if(dereferenceableBytes)
+      loadInstr->setMetadata(LLVMContext::MD_dereferenceable, MDNode::get(context, ConstantAsMetadata::get(ConstantInt::get(int64Type, dereferenceableBytes))));
+    else if(uint64_t dereferenceableOrNullBytes = argument.getDereferenceableOrNullBytes())
+      loadInstr->setMetadata(LLVMContext::MD_dereferenceable_or_null, MDNode::get(context, ConstantAsMetadata::get(ConstantInt::get(int64Type, dereferenceableOrNullBytes))));
+  }
+
+  if(argument.getType()->isIntegerTy())
+    if(std::optional<ConstantRange> range = argument.getRange(); range && !range->isFullSet() && !range->isEmptySet())
+      loadInstr->setMetadata(LLVMContext::MD_range, MDBuilder(context).createRange(range->getLower(), range->getUpper()));
+}
+
+// Clone a macro function with its lambda function and lambda index arguments
+// bound to constants. The resulting function only takes the lambda context in
+// addition to its original arguments, and any call to other macro functions is
+// redirected to their specialization in turn.
+static Function *specializeMacroFunction(Function *function, Function *lambdaFunction, Constant *lambdaIndex, const Twine &suffix, const SmallPtrSetImpl<Function *> &macroClones, SmallDenseMap<Function *, Function *> &specializations)
+{
+  if(auto it = specializations.find(function); it != specializations.end())
+    return it->second;
+
+  ValueToValueMapTy VMap;
+  VMap.insert({ function->getArg(0), lambdaFunction });
+  VMap.insert({ function->getArg(2), lambdaIndex });
+
+  Function *specialization = CloneFunction(function, VMap);
+  specialization->setName(function->getName() + "." + suffix);
+
+  // Macros built from C are nounwind, which only still holds if the lambda
+  // cannot unwind through them.
+  if(!lambdaFunction->doesNotThrow())
+    specialization->removeFnAttr(Attribute::NoUnwind);
+  specializations.insert({function, specialization});
+  ++NumMacroFunctionsSpecialized;
+
+  for(BasicBlock &block : *specialization)
+    for(Instruction &instr : make_early_inc_range(block))
+      if(CallInst *callInstr = dyn_cast<CallInst>(&instr))
+        if(Function *calledFunction = callInstr->getCalledFunction(); calledFunction && macroClones.contains(calledFunction))
+        {
+          Function *calledSpecialization = specializeMacroFunction(calledFunction, lambdaFunction, lambdaIndex, suffix, macroClones, specializations);
+
+          SmallVector<Value *> newArgs;
+          newArgs.push_back(callInstr->getArgOperand(1));
+          newArgs.insert(newArgs.end(), callInstr->arg_begin() + 3, callInstr->arg_end());
+
+          IRBuilder<> builder(callInstr);
+          CallInst *newCallInstr = builder.CreateCall(calledSpecialization->getFunctionType(), calledSpecialization, newArgs);
+          callInstr->replaceAllUsesWith(newCallInstr);
+          callInstr->eraseFromParent();
+        }
+
+  return specialization;
+}
+
+static void eraseSpecializations(SmallDenseMap<Function *, Function *> &specializations)
+{
+  for(auto [function, specialization]: specializations)
+    specialization->dropAllReferences();
+
+  for(auto [function, specialization]: specializations)
+    specialization->eraseFromParent();
+
+  specializations.clear();
+}
+
+// Inline the specialized macro functions between the specialized macro and the
+// call to the lambda, such as a helper calling macro_call() or the next macro
+// when macros are composed, as long as each of them is only called once.
+static void flattenLambdaCall(Function *specializedMacroDef, Function *lambdaFunction, SmallDenseMap<Function *, Function *> &specializations)
+{
+  while(lambdaFunction->hasOneUse())
+  {
+    CallInst *lambdaCallInstr = dyn_cast<CallInst>(lambdaFunction->user_back());
+    if(!lambdaCallInstr)
+      return;
+
+    Function *caller = lambdaCallInstr->getFunction();
+    if(caller == specializedMacroDef || !caller->hasOneUse() || !isInlineViable(*caller).isSuccess())
+      return;
+
+    CallInst *callInstr = dyn_cast<CallInst>(caller->user_back());
+    if(!callInstr || callInstr->getCalledOperand() != caller)
+      return;
+
+    auto it = find_if(specializations, [&](const auto &entry) { return entry.second == caller; });
+    if(it == specializations.end())
+      return;
+
+    InlineFunctionInfo inlineInfo;
+    if(!InlineFunction(*callInstr, inlineInfo).isSuccess())
+      return;
+
+    specializations.erase(it);
+    caller->eraseFromParent();
+  }
+}
+
+// Replace calls to macro_unlikely() by their condition, and outline the regions
+// they guard into cold functions placed in .text.unlikely, so that only the
+// fast path of the macro is expanded into every function. Regions which may
+// call macro_call() are left in place, since the lambda must be called by the
+// macro itself. Outlined functions are macro functions like any other.
+static void outlineColdRegions(SmallVectorImpl<std::reference_wrapper<Function>> &macroFunctions, Function *macroUnlikely, Function *macroCall)
+{
+  SmallPtrSet<Function *, 16> macroFunctionSet;
+  for(Function &function: macroFunctions)
+    macroFunctionSet.insert(&function);
+
+  // Macro functions from which macro_call() may be reached, which includes the
+  // entry points of the next macros when macros are composed.
+  SmallPtrSet<Function *, 16> callingFunctions;
+  if(macroCall)
+    callingFunctions.insert(macroCall);
+
+  for(bool changed = true; changed;)
+  {
+    changed = false;
+    for(Function &function: macroFunctions)
+      if(!callingFunctions.contains(&function))
+        for(Instruction &instr: instructions(function))
+          if(CallBase *callInstr = dyn_cast<CallBase>(&instr); callInstr && callingFunctions.contains(callInstr->getCalledFunction()))
+          {
+            callingFunctions.insert(&function);
+            changed = true;
+            break;
+          }
+  }
+
+  SmallVector<CallInst *> unlikelyCalls;
+  for(User *user: macroUnlikely->users())
+  {
+    CallInst *callInstr = dyn_cast<CallInst>(user);
+    if(!callInstr || callInstr->getCalledOperand() != macroUnlikely)
+      report_fatal_error("macro_unlikely must only be called directly", false);
+
+    unlikelyCalls.push_back(callInstr);
+  }
+
+  for(CallInst *callInstr: unlikelyCalls)
+  {
+    // As in if(macro_unlikely(condition)), i.e. a branch on the result
+    // compared to 0, possibly negated as in macro_cold or inverted by
+    // InstCombine into a comparison for equality with swapped successors. The
+    // region is then everything dominated by the cold successor.
+    BranchInst *branchInstr = nullptr;
+    unsigned coldSuccessor = 0;
+    for(User *user: callInstr->users())
+      if(ICmpInst *cmpInstr = dyn_cast<ICmpInst>(user); cmpInstr && cmpInstr->isEquality() && isa<Constant>(cmpInstr->getOperand(1)) && cast<Constant>(cmpInstr->getOperand(1))->isNullValue())
+      {
+        Value *condition = cmpInstr;
+        unsigned successor = cmpInstr->getPredicate() == ICmpInst::ICMP_NE ? 0 : 1;
+        while(condition->hasOneUse() && PatternMatch::match(condition->user_back(), PatternMatch::m_Not(PatternMatch::m_Specific(condition))))
+        {
+          condition = condition->user_back();
+          successor ^= 1;
+        }
+
+        for(User *conditionUser: condition->users())
+          if(BranchInst *conditionBranchInstr = dyn_cast<BranchInst>(conditionUser); conditionBranchInstr && conditionBranchInstr->isConditional())
+          {
+            branchInstr = conditionBranchInstr;
+            coldSuccessor = successor;
+          }
+      }
+
+    callInstr->replaceAllUsesWith(callInstr->getArgOperand(0));
+    callInstr->eraseFromParent();
+    if(!branchInstr)
+      continue;
+
+    MDBuilder mdBuilder(branchInstr->getContext());
+    branchInstr->setMetadata(LLVMContext::MD_prof, coldSuccessor == 0 ? mdBuilder.createBranchWeights(1, 2000) : mdBuilder.createBranchWeights(2000, 1));
+
+    Function *function = branchInstr->getFunction();
+    BasicBlock *coldBlock = branchInstr->getSuccessor(coldSuccessor);
+    if(!optOutlineCold || !macroFunctionSet.contains(function) || coldBlock->getSinglePredecessor() != branchInstr->getParent())
+      continue;
+
+    DominatorTree dominatorTree(*function);
+    SmallVector<BasicBlock *> region;
+    dominatorTree.getDescendants(coldBlock, region);
+
+    bool callsMacro = any_of(region, [&](BasicBlock *block) {
+      return any_of(*block, [&](Instruction &instr) {
+        CallBase *regionCallInstr = dyn_cast<CallBase>(&instr);
+        return regionCallInstr && callingFunctions.contains(regionCallInstr->getCalledFunction());
+      });
+    });
+    if(callsMacro)
+      continue;
+
+    CodeExtractor extractor(region, &dominatorTree, false, nullptr, nullptr, nullptr, false, false, nullptr, "cold");
+    if(!extractor.isEligible())
+      continue;
+
+    CodeExtractorAnalysisCache analysisCache(*function);
+    Function *coldFunction = extractor.extractCodeRegion(analysisCache);
+    if(!coldFunction)
+      continue;
+
+    coldFunction->addFnAttr(Attribute::Cold);
+    coldFunction->addFnAttr(Attribute::NoInline);
+    coldFunction->setSectionPrefix("unlikely");
+    macroFunctions.push_back(*coldFunction);
+    macroFunctionSet.insert(coldFunction);
+    ++NumColdRegionsOutlined;
+  }
+}
+
+// Outline the loops of the function selected by -macro-loop-depth and
+// -macro-loop-min-trip-count into functions of their own, and collect the calls
+// to them. Inner loops are outlined first, so that the call to an inner loop
+// ends up in the function of its outer loop if both are selected. With a trip
+// count variable, every outlined loop counts how many times its header runs
+// and stores the count into the variable before returning.
+static void outlineLoops(Function &function, FunctionAnalysisManager &functionAnalysisManager, GlobalVariable *tripCountVariable, SmallVectorImpl<CallBase *> &loopCalls)
+{
+  LoopInfo &loopInfo = functionAnalysisManager.getResult<LoopAnalysis>(function);
+  ScalarEvolution &scalarEvolution = functionAnalysisManager.getResult<ScalarEvolutionAnalysis>(function);
+
+  SmallVector<std::pair<unsigned, BasicBlock *>> headers;
+  for(Loop *loop: loopInfo.getLoopsInPreorder())
+  {
+    if(loop->getLoopDepth() > optLoopDepth)
+      continue;
+
+    if(optLoopMinTripCount != 0)
+    {
+      unsigned tripCount = scalarEvolution.getSmallConstantTripCount(loop);
+      if(tripCount == 0)
+        tripCount = getLoopEstimatedTripCount(loop).value_or(0);
+      if(tripCount < optLoopMinTripCount)
+        continue;
+    }
+
+    headers.push_back({loop->getLoopDepth(), loop->getHeader()});
+  }
+
+  if(headers.empty())
+    return;
+
+  stable_sort(headers, [](const auto &a, const auto &b) { return a.first > b.first; });
+  functionAnalysisManager.invalidate(function, PreservedAnalyses::none());
+
+  for(auto [depth, header]: headers)
+  {
+    DominatorTree dominatorTree(function);
+    LoopInfo currentLoopInfo(dominatorTree);
+    Loop *loop = currentLoopInfo.getLoopFor(header);
+    if(!loop || loop->getHeader() != header)
+      continue;
+
+    DebugLoc startLoc = loop->getStartLoc();
+    CodeExtractor extractor(loop->getBlocks(), &dominatorTree, false, nullptr, nullptr, nullptr, false, false, nullptr, "loop");
+    if(!extractor.isEligible())
+      continue;
+
+    CodeExtractorAnalysisCache analysisCache(function);
+    Function *loopFunction = extractor.extractCodeRegion(analysisCache);
+    if(!loopFunction)
+      continue;
+
+    CallBase *callInstr = cast<CallBase>(loopFunction->user_back());
+    if(startLoc)
+      callInstr->setDebugLoc(startLoc);
+
+    if(tripCountVariable)
+    {
+      Type *int64Type = tripCountVariable->getValueType();
+
+      IRBuilder<> builder(&*loopFunction->getEntryBlock().getFirstInsertionPt());
+      Value *tripCount = builder.CreateAlloca(int64Type);
+      builder.CreateStore(ConstantInt::get(int64Type, 0), tripCount);
+
+      builder.SetInsertPoint(&*header->getFirstInsertionPt());
+      builder.CreateStore(builder.CreateAdd(builder.CreateLoad(int64Type, tripCount), ConstantInt::get(int64Type, 1)), tripCount);
+
+      for(BasicBlock &block: *loopFunction)
+        if(ReturnInst *returnInstr = dyn_cast<ReturnInst>(block.getTerminator()))
+        {
+          builder.SetInsertPoint(returnInstr);
+          builder.CreateStore(builder.CreateLoad(int64Type, tripCount), builder.CreateThreadLocalAddress(tripCountVariable));
+        }
+    }
+
+    loopCalls.push_back(callInstr);
+  }
+}
+
+// Return whether the macro is simple enough to be inlined into the trampoline
+// together with the lambda, i.e. the lambda is called exactly once outside of
+// any loop, either by the macro itself or through macro functions which are
+// only called once and are therefore flattened into it by flattenLambdaCall(),
+// so that the original body is not duplicated. This only depends on the macro,
+// so it is decided once on its clone, in which the lambda is the first argument
+// of every macro function.
+static bool isSimpleMacro(Function *macroDef, const SmallPtrSetImpl<Function *> &macroClones)
+{
+  SmallPtrSet<Function *, 16> reachable;
+  collectReachableFunctions(macroDef, macroClones, reachable);
+
+  SmallDenseMap<Function *, unsigned> callCounts;
+  SmallPtrSet<Function *, 16> callingFunctions;
+  for(Function *function: reachable)
+    for(Instruction &instr: instructions(*function))
+      if(CallBase *callInstr = dyn_cast<CallBase>(&instr))
+      {
+        if(callInstr->getCalledOperand() == function->getArg(0))
+          callingFunctions.insert(function);
+        else if(Function *calledFunction = callInstr->getCalledFunction(); calledFunction && reachable.contains(calledFunction))
+          ++callCounts[calledFunction];
+      }
+
+  // Macro functions from which the lambda may be called.
+  for(bool changed = true; changed;)
+  {
+    changed = false;
+    for(Function *function: reachable)
+      if(!callingFunctions.contains(function))
+        for(Instruction &instr: instructions(*function))
+          if(CallBase *callInstr = dyn_cast<CallBase>(&instr); callInstr && callingFunctions.contains(callInstr->getCalledFunction()))
+          {
+            callingFunctions.insert(function);
+            changed = true;
+            break;
+          }
+  }
+
+  // Follow the only path from the macro down to the call of the lambda.
+  for(Function *function = macroDef; callCounts.lookup(function) == (function == macroDef ? 0 : 1);)
+  {
+    if(!isInlineViable(*function).isSuccess())
+      return false;
+
+    CallBase *pathCallInstr = nullptr;
+    for(Instruction &instr: instructions(*function))
+      if(CallBase *callInstr = dyn_cast<CallBase>(&instr); callInstr && (callInstr->getCalledOperand() == function->getArg(0) || callingFunctions.contains(callInstr->getCalledFunction())))
+      {
+        if(pathCallInstr)
+          return false;
+        pathCallInstr = callInstr;
+      }
+
+    if(!pathCallInstr || !isa<CallInst>(pathCallInstr))
+      return false;
+
+    DominatorTree dominatorTree(*function);
+    LoopInfo loopInfo(dominatorTree);
+    if(loopInfo.getLoopFor(pathCallInstr->getParent()))
+      return false;
+
+    if(pathCallInstr->getCalledOperand() == function->getArg(0))
+      return true;
+
+    function = pathCallInstr->getCalledFunction();
+  }
+
+  return false;
+}
+
 static const APInt *valueAsConstantInt(Value *value)
 {
   ConstantInt *constant = dyn_cast<ConstantInt>(value);
@@ -84,383 +898,2226 @@ static int valueAsUint64(uint64_t &result, Value *value)
   return 0;
 }
 
-class MacroModulePass : public PassInfoMixin<MacroModulePass>
+enum class StorageClass
+{
+  Static,
+  ThreadLocal,
+  PerCPU,
+};
+
+struct ArraySpec
+{
+  uint64_t size;
+  uint64_t alignment;
+  StorageClass storage;
+};
+
+// Validate the arguments of a call to one of the storage builtins such as
+// macro_array() or macro_local_ptr() and return the id.
+static uint64_t arrayCallSpec(CallInst *callInstr, StringRef signature, ArraySpec &spec)
+{
+  // Note: We kinda relied on the frontend to do all necessary constant
+  //       folding.
+  //
+  // Note: While we are checking for overflow, size_t is always smaller than
+  //       uint64_t until the day we start using 128-bit computer, so the
+  //       overflow should never happen.
+
+  uint64_t id;
+  switch(valueAsUint64(id, callInstr->getOperand(0)))
+  {
+  case ERROR_NOT_CONSTANT:
+    report_fatal_error("id argument passed to " + signature + " must be a constant");
+  case ERROR_OVERFLOW:
+    report_fatal_error("overflow on id argument passed to " + signature);
+  }
+
+  uint64_t size;
+  switch(valueAsUint64(size, callInstr->getOperand(1)))
+  {
+  case ERROR_NOT_CONSTANT:
+    report_fatal_error("size argument passed to " + signature + " must be a constant");
+  case ERROR_OVERFLOW:
+    report_fatal_error("overflow on size argument passed to " + signature);
+  }
+
+  uint64_t alignment;
+  switch(valueAsUint64(alignment, callInstr->getOperand(2)))
+  {
+  case ERROR_NOT_CONSTANT:
+    report_fatal_error("alignment argument passed to " + signature + " must be a constant");
+  case ERROR_OVERFLOW:
+    report_fatal_error("overflow on alignment argument passed to " + signature);
+  }
+
+  if(alignment == 0)
+    report_fatal_error("alignment argument passed to " + signature + " must be a non-zero");
+
+  if(!isPowerOf2_64(alignment))
+    report_fatal_error("alignment argument passed to " + signature + " must be power of 2");
+
+  if(size % alignment != 0)
+    report_fatal_error("alignment argument passed to " + signature + " must divide size");
+
+  spec.size = size;
+  spec.alignment = alignment;
+  return id;
+}
+
+static bool valueReferencesAny(Value *value, const SmallPtrSetImpl<Value *> &values)
+{
+  if(values.contains(value))
+    return true;
+
+  if(ConstantExpr *constantExpr = dyn_cast<ConstantExpr>(value))
+    for(Value *operand: constantExpr->operands())
+      if(valueReferencesAny(operand, values))
+        return true;
+
+  return false;
+}
+
+// Decide which functions in the main module the macro is expanded into, based
+// on the selection options and the macro_skip/macro_only annotations.
+class FunctionSelector
 {
 public:
-  PreservedAnalyses run(Module &module, ModuleAnalysisManager &)
+  explicit FunctionSelector(Module &module)
   {
-    LLVMContext &context = module.getContext();
-    const DataLayout &dataLayout = module.getDataLayout();
+    for(const std::string &pattern: optInclude)
+      includes.push_back(compile(pattern, "-macro-include"));
 
-    Type *voidType = Type::getVoidTy(context);
-    PointerType *opaquePointerType = PointerType::get(context, 0);
-    IntegerType *int32Type = IntegerType::getInt32Ty(context);
-    IntegerType *int8Type = IntegerType::getInt8Ty(context);
+    for(const std::string &pattern: optExclude)
+      excludes.push_back(compile(pattern, "-macro-exclude"));
+
+    for(const std::string &pattern: optCallSite)
+      callSites.push_back(compile(pattern, "-macro-callsite"));
+
+    // Annotations are collected in the global array llvm.global.annotations
+    // with elements of type { ptr, ptr, ptr, i32, ptr } in which the first
+    // two fields are the annotated value and the annotation string.
+    if(GlobalVariable *annotations = module.getGlobalVariable("llvm.global.annotations"))
+      if(ConstantArray *array = dyn_cast_or_null<ConstantArray>(annotations->getInitializer()))
+        for(Value *operand: array->operands())
+        {
+          ConstantStruct *annotation = dyn_cast<ConstantStruct>(operand);
+          if(!annotation || annotation->getNumOperands() < 2)
+            continue;
+
+          Function *function = dyn_cast<Function>(annotation->getOperand(0)->stripPointerCasts());
+          GlobalVariable *string = dyn_cast<GlobalVariable>(annotation->getOperand(1)->stripPointerCasts());
+          if(!function || !string || !string->hasInitializer())
+            continue;
+
+          ConstantDataArray *data = dyn_cast<ConstantDataArray>(string->getInitializer());
+          if(!data || !data->isCString())
+            continue;
+
+          StringRef name = data->getAsCString();
+          if(name == "macro_skip")
+            skipped.insert(function);
+          else if(name == "macro_only")
+            only.insert(function);
+        }
+  }
+
+public:
+  // Return why the macro is not expanded into the function, or an empty
+  // string if it is.
+  StringRef skipReason(Function &function) const
+  {
+    if(skipped.contains(&function))
+      return "macro_skip";
+
+    if(!only.empty() && !only.contains(&function))
+      return "macro_only";
+
+    if(function.hasFnAttribute(Attribute::AlwaysInline))
+      return "always_inline";
+
+    if(function.hasFnAttribute(Attribute::Naked))
+      return "naked";
+
+    if(function.hasFnAttribute("thunk"))
+      return "thunk";
+
+    if(function.size() < optMinBlocks)
+      return "min-blocks";
+
+    if(function.getInstructionCount() < optMinInstructions)
+      return "min-instructions";
+
+    // A musttail call requires the caller to have the same signature as the
+    // callee, which no longer holds once the body is moved into the lambda.
+    for(BasicBlock &block: function)
+      if(block.getTerminatingMustTailCall())
+        return "musttail";
+
+    if(includes.empty() && excludes.empty())
+      return "";
+
+    std::string name = function.getName().str();
+    std::string demangledName = demangle(name);
+
+    auto matches = [&](const Regex &regex) { return regex.match(name) || regex.match(demangledName); };
+    if(!includes.empty() && none_of(includes, matches))
+      return "include";
+
+    if(any_of(excludes, matches))
+      return "exclude";
+
+    return "";
+  }
+
+  bool isSelectedCallSite(CallBase &callInstr) const
+  {
+    if(callSites.empty())
+      return false;
+
+    Function *callee = callInstr.getCalledFunction();
+    if(!callee || callee->isIntrinsic())
+      return false;
+
+    // The callee of a musttail call must be called from the function itself,
+    // functions which return twice (e.g. setjmp() or vfork()) must not return
+    // into a frame which is gone, and operand bundles are tied to the caller.
+    if(callInstr.isMustTailCall() || callInstr.hasFnAttr(Attribute::ReturnsTwice) || callInstr.hasOperandBundles() || isa<CallBrInst>(callInstr))
+      return false;
+
+    std::string name = callee->getName().str();
+    std::string demangledName = demangle(name);
+
+    return any_of(callSites, [&](const Regex &regex) { return regex.match(name) || regex.match(demangledName); });
+  }
+
+private:
+  static Regex compile(const std::string &pattern, StringRef option)
+  {
+    Regex regex(pattern);
+
+    std::string error;
+    if(!regex.isValid(error))
+      report_fatal_error("invalid regex " + Twine(pattern) + " passed to " + option + ": " + Twine(error), false);
+
+    return regex;
+  }
+
+private:
+  SmallVector<Regex> includes;
+  SmallVector<Regex> excludes;
+  SmallVector<Regex> callSites;
+
+  SmallPtrSet<Function *, 8> skipped;
+  SmallPtrSet<Function *, 8> only;
+};
+
+// What the pass did to a single function or call site, as reported with
+// -macro-report. Skipped functions have a skip reason and no lowering.
+struct ExpansionReport
+{
+  std::string name;
+  std::string caller;
+  StringRef skipReason;
+  bool hot = false;
+  size_t number = 0;
+  StringRef lowering;
+  unsigned instructionsBefore = 0;
+  unsigned instructionsAfter = 0;
+};
+
+struct StorageReport
+{
+  uint64_t id;
+  StorageClass storageClass;
+  uint64_t size;
+  uint64_t alignment;
+  bool lazy;
+};
+
+// Append the report of a module as a single line of JSON, written at once so
+// that modules compiled in parallel can share the same file.
+static void writeReport(Module &module, ArrayRef<std::string> macroFilenames, ArrayRef<ExpansionReport> functionReports, ArrayRef<ExpansionReport> callSiteReports, ArrayRef<ExpansionReport> loopReports, ArrayRef<StorageReport> storageReports, uint64_t storageBytes, size_t macroFunctionsCloned)
+{
+  std::string line;
+  raw_string_ostream lineStream(line);
+  json::OStream json(lineStream);
+  json.object([&] {
+    json.attribute("module", module.getModuleIdentifier());
+    json.attribute("source_file", module.getSourceFileName());
+    json.attributeArray("macros", [&] {
+      for(const std::string &macroFilename: macroFilenames)
+        json.value(macroFilename);
+    });
+    json.attribute("macro_functions_cloned", int64_t(macroFunctionsCloned));
+    json.attribute("storage_bytes", int64_t(storageBytes));
+    json.attributeArray("storage", [&] {
+      for(const StorageReport &report: storageReports)
+        json.object([&] {
+          json.attribute("id", int64_t(report.id));
+          switch(report.storageClass)
+          {
+          case StorageClass::Static:      json.attribute("class", "static"); break;
+          case StorageClass::ThreadLocal: json.attribute("class", "thread_local"); break;
+          case StorageClass::PerCPU:      json.attribute("class", "percpu"); break;
+          }
+          json.attribute("size", int64_t(report.size));
+          json.attribute("alignment", int64_t(report.alignment));
+          json.attribute("lazy", report.lazy);
+        });
+    });
+    json.attributeArray("functions", [&] {
+      for(const ExpansionReport &report: functionReports)
+        json.object([&] {
+          json.attribute("name", report.name);
+          json.attribute("selected", report.skipReason.empty());
+          json.attribute("hot", report.hot);
+          if(!report.skipReason.empty())
+          {
+            json.attribute("reason", report.skipReason);
+            json.attribute("instructions", int64_t(report.instructionsBefore));
+            return;
+          }
+          json.attribute("number", int64_t(report.number));
+          json.attribute("lowering", report.lowering);
+          json.attribute("instructions_before", int64_t(report.instructionsBefore));
+          json.attribute("instructions_after", int64_t(report.instructionsAfter));
+        });
+    });
+    json.attributeArray("callsites", [&] {
+      for(const ExpansionReport &report: callSiteReports)
+        json.object([&] {
+          json.attribute("callee", report.name);
+          json.attribute("caller", report.caller);
+          json.attribute("number", int64_t(report.number));
+          json.attribute("lowering", report.lowering);
+          json.attribute("instructions_after", int64_t(report.instructionsAfter));
+        });
+    });
+    json.attributeArray("loops", [&] {
+      for(const ExpansionReport &report: loopReports)
+        json.object([&] {
+          json.attribute("name", report.name);
+          json.attribute("function", report.caller);
+          json.attribute("number", int64_t(report.number));
+          json.attribute("lowering", report.lowering);
+          json.attribute("instructions_after", int64_t(report.instructionsAfter));
+        });
+    });
+  });
+  line += '\n';
+
+  std::error_code ec;
+  raw_fd_ostream stream(optReport, ec, sys::fs::OF_Append | sys::fs::OF_Text);
+  if(ec)
+    report_fatal_error("failed to open -macro-report file " + Twine(optReport) + ": " + ec.message(), false);
+
+  stream.SetUnbuffered();
+  stream << line;
+  if(stream.has_error())
+    report_fatal_error("failed to write -macro-report file " + Twine(optReport) + ": " + stream.error().message(), false);
+}
+
+class MacroModulePass : public PassInfoMixin<MacroModulePass>
+{
+public:
+  PreservedAnalyses run(Module &module, ModuleAnalysisManager &moduleAnalysisManager)
+  {
+    // The pass may be scheduled more than once on the same module, e.g. in
+    // both the pre-link and the link time pipeline with LTO, so every function
+    // defined once the macro is applied is marked. With full LTO, inputs to
+    // which the macro was applied may also be merged with inputs to which it
+    // was not, in which case neither skipping the module nor applying the
+    // macro to it again is right.
+    Function *appliedFunction = nullptr;
+    Function *otherFunction = nullptr;
+    for(Function &function: module)
+      if(!function.isDeclaration() && !function.hasAvailableExternallyLinkage())
+        (function.hasFnAttribute("macro-applied") ? appliedFunction : otherFunction) = &function;
+
+    if(appliedFunction && otherFunction)
+      report_fatal_error("the macro was already applied to some functions of the module (e.g. " + appliedFunction->getName() + ") but not to others (e.g. " + otherFunction->getName() + "), which happens when linking inputs compiled with and without the macro with LTO; apply it at only one -macro-ep", false);
+
+    if(appliedFunction)
+      return PreservedAnalyses::all();
+
+    LLVMContext &context = module.getContext();
+    const DataLayout &dataLayout = module.getDataLayout();
+
+    Type *voidType = Type::getVoidTy(context);
+    PointerType *opaquePointerType = PointerType::get(context, 0);
+    IntegerType *int32Type = IntegerType::getInt32Ty(context);
+    IntegerType *int64Type = IntegerType::getInt64Ty(context);
+    IntegerType *int8Type = IntegerType::getInt8Ty(context);
+
+    unsigned int sizeWidth = dataLayout.getPointerSizeInBits();
+    IntegerType *sizeType = IntegerType::getIntNTy(context, sizeWidth);
+
+    FunctionSelector functionSelector(module);
+
+    // With -time-passes, the time spent in each phase of the pass is reported
+    // separately.
+    std::optional<NamedRegionTimer> phaseTimer;
+    auto startPhase = [&](StringRef name, StringRef description) {
+      phaseTimer.reset();
+      phaseTimer.emplace(name, description, "macro", "Macro pass phases", TimePassesIsEnabled);
+    };
+
+    startPhase("link", "Load and link the macro");
+
+    SMDiagnostic err;
+
+    // With multiple -macro arguments, the macros are first linked together
+    // into a single macro in which the macro_call() of each macro is a direct
+    // call to the next one, so that there is still a single trampoline and
+    // lambda context per function.
+    ArrayRef<std::string> macroFilenames = MacroFilename::get();
+    if(macroFilenames.size() > 256)
+      report_fatal_error("too many -macro <macrofilename> arguments passed", false);
+
+    // The cache entries own the buffers the lazily loaded modules refer to, and
+    // must outlive the linking even if the cache is refreshed in the meantime.
+    SmallVector<std::shared_ptr<const MacroModuleCache::Entry>> macroModuleEntries;
+    std::unique_ptr<Module> macroModule;
+    uint64_t macroHash = 0;
+    StringRef composedEntryName;
+    for(size_t i=0; i<macroFilenames.size(); ++i)
+    {
+      const std::string &macroFilename = macroFilenames[i];
+
+      std::shared_ptr<const MacroModuleCache::Entry> macroModuleEntry = macroModuleEntries.emplace_back(MacroModuleCache::get(macroFilename));
+      std::unique_ptr<Module> partModule = getLazyIRModule(MemoryBuffer::getMemBuffer(macroModuleEntry->buffer->getMemBufferRef(), false), err, context);
+      if(!partModule)
+        report_fatal_error("failed to load macro module:" + Twine(macroFilename) + " (note: textual IR is not supported when invoked via clang, this may or may not be the issue)", false);
+
+      SmallVector<GlobalValue *> macroRoots;
+      for(StringRef name: {"macro_def", "macro_def_hot", "macro_def_callsite", "macro_def_loop"})
+        if(Function *function = partModule->getFunction(name))
+          macroRoots.push_back(function);
+
+      materializeReachable(*partModule, macroRoots);
+
+      if(i == 0)
+        macroHash = macroModuleEntry->hash;
+      else
+      {
+        uint64_t hashes[2] = { macroHash, macroModuleEntry->hash };
+        macroHash = xxHash64(ArrayRef(reinterpret_cast<const uint8_t *>(hashes), sizeof(hashes)));
+      }
+
+      if(macroFilenames.size() > 1)
+        composeMacroModule(*partModule, i, macroFilenames.size(), composedEntryName, macroFilename);
+
+      if(!macroModule)
+        macroModule = std::move(partModule);
+      else if(Linker::linkModules(*macroModule, std::move(partModule)))
+        report_fatal_error("failed to compose macro module:" + Twine(macroFilename), false);
+    }
+
+    // Names of local symbols from the macro module are made deterministic (and
+    // distinct from symbols of other macros) so that the same macro function
+    // ends up with the same name in every module.
+    std::string macroPrefix = "macro." + utohexstr(macroHash, /*LowerCase=*/true) + ".";
+    if(optComdat)
+      for(GlobalValue &value: macroModule->global_values())
+        if(!value.isDeclaration() && value.hasLocalLinkage() && !value.hasPrivateLinkage())
+          value.setName(macroPrefix + value.getName());
+
+    SmallPtrSet<GlobalVariable *, 16> mainGlobals;
+    for(GlobalVariable &globalVariable: module.globals())
+      mainGlobals.insert(&globalVariable);
+
+    auto moduleSplitIt = --module.end();
+    if(Linker::linkModules(module, std::move(macroModule)))
+      report_fatal_error("failed to link macro module:" + Twine(join(macroFilenames, ",")), false);
+    ++moduleSplitIt;
+
+    SmallVector<std::reference_wrapper<Function>> mainFunctions(module.begin(), moduleSplitIt);
+    SmallVector<std::reference_wrapper<Function>> macroFunctions(moduleSplitIt, module.end());
+
+    bool comdat = optComdat && Triple(module.getTargetTriple()).supportsCOMDAT();
+
+    // With -macro-index-scope=program, every module contributes one byte per
+    // wrapped function to the __macro_index section and the index of a
+    // function is the offset of its byte from the start of the section, as
+    // laid out by the linker. Storage for macro_array() works the same way
+    // with one section per id, so that the arrays are contiguous over the
+    // whole program.
+    bool programScope = optIndexScope == IndexScope::Program;
+    if(programScope && !Triple(module.getTargetTriple()).isOSBinFormatELF())
+      report_fatal_error("-macro-index-scope=program is only supported for ELF targets", false);
+
+    GlobalVariable *indexSlots = nullptr;
+    GlobalVariable *indexStart = nullptr;
+    if(programScope)
+    {
+      indexSlots = new GlobalVariable(module, int8Type, false, GlobalValue::ExternalLinkage, nullptr, "macro.index");
+      indexStart = sectionBoundary(module, "__macro_index", false);
+    }
+
+    // Definitions from the macro module are linked into every module the macro
+    // is applied to, so they must not have external linkage or they would be
+    // defined multiple times in the final program. With -macro-comdat, global
+    // variables are instead shared between all modules.
+    for(GlobalVariable &globalVariable: module.globals())
+      if(!mainGlobals.contains(&globalVariable) && !globalVariable.isDeclaration() && !globalVariable.hasAppendingLinkage())
+      {
+        if(optComdat && !globalVariable.isConstant() && (globalVariable.hasLocalLinkage() || globalVariable.hasExternalLinkage()))
+        {
+          globalVariable.setLinkage(GlobalValue::LinkOnceODRLinkage);
+          globalVariable.setVisibility(GlobalValue::HiddenVisibility);
+          if(comdat)
+            globalVariable.setComdat(module.getOrInsertComdat(globalVariable.getName()));
+        }
+        else if(globalVariable.hasExternalLinkage())
+          globalVariable.setLinkage(GlobalValue::InternalLinkage);
+      }
+
+    Function *macroDef = nullptr;
+    Function *macroDefHot = nullptr;
+    Function *macroDefCallSite = nullptr;
+    Function *macroDefLoop = nullptr;
+    Function *macroCall = nullptr;
+    Function *macroCount = nullptr;
+    Function *macroIndex = nullptr;
+    Function *macroArray = nullptr;
+    Function *macroLocalPtr = nullptr;
+    Function *macroTlsArray = nullptr;
+    Function *macroLocalTlsPtr = nullptr;
+    Function *macroLocalPercpuPtr = nullptr;
+    Function *macroLocalPercpuShardPtr = nullptr;
+    Function *macroPercpuCount = nullptr;
+    Function *macroFunctionName = nullptr;
+    Function *macroSourceFile = nullptr;
+    Function *macroSourceLine = nullptr;
+    Function *macroFunctionId = nullptr;
+    Function *macroArgCount = nullptr;
+    Function *macroArgPtr = nullptr;
+    Function *macroArgSize = nullptr;
+    Function *macroReturnPtr = nullptr;
+    Function *macroUnlikely = nullptr;
+    Function *macroLoopTripCount = nullptr;
+
+    for(Function &function: macroFunctions)
+    {
+      StringRef name = function.getName();
+      if(!macroDef && name == "macro_def")
+      {
+        macroDef = &function;
+        if(!functionIsDefined(*macroDef) || !functionCheckSignature(*macroDef, voidType, {}))
+          report_fatal_error("invalid definition of macro_def: macro_def must be a defined function with the following signature (without name mangling): void macro_def(void)", false);
+      }
+      else if(!macroDefHot && name == "macro_def_hot")
+      {
+        macroDefHot = &function;
+        if(!functionIsDefined(*macroDefHot) || !functionCheckSignature(*macroDefHot, voidType, {}))
+          report_fatal_error("invalid definition of macro_def_hot: macro_def_hot must be a defined function with the following signature (without name mangling): void macro_def_hot(void)", false);
+      }
+      else if(!macroDefCallSite && name == "macro_def_callsite")
+      {
+        macroDefCallSite = &function;
+        if(!functionIsDefined(*macroDefCallSite) || !functionCheckSignature(*macroDefCallSite, voidType, {}))
+          report_fatal_error("invalid definition of macro_def_callsite: macro_def_callsite must be a defined function with the following signature (without name mangling): void macro_def_callsite(void)", false);
+      }
+      else if(!macroDefLoop && name == "macro_def_loop")
+      {
+        macroDefLoop = &function;
+        if(!functionIsDefined(*macroDefLoop) || !functionCheckSignature(*macroDefLoop, voidType, {}))
+          report_fatal_error("invalid definition of macro_def_loop: macro_def_loop must be a defined function with the following signature (without name mangling): void macro_def_loop(void)", false);
+      }
+      else if(!macroCall && name == "macro_call")
+      {
+        macroCall = &function;
+        if(functionIsDefined(*macroCall) || !functionCheckSignature(*macroCall, voidType, {}))
+          report_fatal_error("invalid definition of macro_call: macro_call must be a external function with the following signature (without name mangling): void macro_call(void)", false);
+      }
+      else if(!macroCount && name == "macro_count")
+      {
+        macroCount = &function;
+        if(functionIsDefined(*macroCount) || !functionCheckSignature(*macroCount, sizeType, {}))
+          report_fatal_error("invalid definition of macro_count: macro_count must be a external function with the following signature (without name mangling): size_t macro_count(void)", false);
+      }
+      else if(!macroIndex && name == "macro_index")
+      {
+        macroIndex = &function;
+        if(functionIsDefined(*macroIndex) || !functionCheckSignature(*macroIndex, sizeType, {}))
+          report_fatal_error("invalid definition of macro_index: macro_index must be a external function with the following signature (without name mangling): size_t macro_index(void)", false);
+      }
+      else if(!macroArray && name == "macro_array")
+      {
+        macroArray = &function;
+        if(functionIsDefined(*macroArray) || !functionCheckSignature(*macroArray, opaquePointerType, {sizeType, sizeType, sizeType}))
+          report_fatal_error("invalid definition of macro_array: macro_array must be a external function with the following signature (without name mangling): void *macro_array(size_t id, size_t size, size_t alignment)", false);
+      }
+      else if(!macroLocalPtr && name == "macro_local_ptr")
+      {
+        macroLocalPtr = &function;
+        if(functionIsDefined(*macroLocalPtr) || !functionCheckSignature(*macroLocalPtr, opaquePointerType, {sizeType, sizeType, sizeType}))
+          report_fatal_error("invalid definition of macro_local_ptr: macro_local_ptr must be a external function with the following signature (without name mangling): void *macro_local_ptr(size_t id, size_t size, size_t alignment)", false);
+      }
+      else if(!macroTlsArray && name == "macro_tls_array")
+      {
+        macroTlsArray = &function;
+        if(functionIsDefined(*macroTlsArray) || !functionCheckSignature(*macroTlsArray, opaquePointerType, {sizeType, sizeType, sizeType}))
+          report_fatal_error("invalid definition of macro_tls_array: macro_tls_array must be a external function with the following signature (without name mangling): void *macro_tls_array(size_t id, size_t size, size_t alignment)", false);
+      }
+      else if(!macroLocalTlsPtr && name == "macro_local_tls_ptr")
+      {
+        macroLocalTlsPtr = &function;
+        if(functionIsDefined(*macroLocalTlsPtr) || !functionCheckSignature(*macroLocalTlsPtr, opaquePointerType, {sizeType, sizeType, sizeType}))
+          report_fatal_error("invalid definition of macro_local_tls_ptr: macro_local_tls_ptr must be a external function with the following signature (without name mangling): void *macro_local_tls_ptr(size_t id, size_t size, size_t alignment)", false);
+      }
+      else if(!macroLocalPercpuPtr && name == "macro_local_percpu_ptr")
+      {
+        macroLocalPercpuPtr = &function;
+        if(functionIsDefined(*macroLocalPercpuPtr) || !functionCheckSignature(*macroLocalPercpuPtr, opaquePointerType, {sizeType, sizeType, sizeType}))
+          report_fatal_error("invalid definition of macro_local_percpu_ptr: macro_local_percpu_ptr must be a external function with the following signature (without name mangling): void *macro_local_percpu_ptr(size_t id, size_t size, size_t alignment)", false);
+      }
+      else if(!macroLocalPercpuShardPtr && name == "macro_local_percpu_shard_ptr")
+      {
+        macroLocalPercpuShardPtr = &function;
+        if(functionIsDefined(*macroLocalPercpuShardPtr) || !functionCheckSignature(*macroLocalPercpuShardPtr, opaquePointerType, {sizeType, sizeType, sizeType, sizeType}))
+          report_fatal_error("invalid definition of macro_local_percpu_shard_ptr: macro_local_percpu_shard_ptr must be a external function with the following signature (without name mangling): void *macro_local_percpu_shard_ptr(size_t id, size_t size, size_t alignment, size_t shard)", false);
+      }
+      else if(!macroPercpuCount && name == "macro_percpu_count")
+      {
+        macroPercpuCount = &function;
+        if(functionIsDefined(*macroPercpuCount) || !functionCheckSignature(*macroPercpuCount, sizeType, {}))
+          report_fatal_error("invalid definition of macro_percpu_count: macro_percpu_count must be a external function with the following signature (without name mangling): size_t macro_percpu_count(void)", false);
+      }
+      else if(!macroFunctionName && name == "macro_function_name")
+      {
+        macroFunctionName = &function;
+        if(functionIsDefined(*macroFunctionName) || !functionCheckSignature(*macroFunctionName, opaquePointerType, {}))
+          report_fatal_error("invalid definition of macro_function_name: macro_function_name must be a external function with the following signature (without name mangling): const char *macro_function_name(void)", false);
+      }
+      else if(!macroSourceFile && name == "macro_source_file")
+      {
+        macroSourceFile = &function;
+        if(functionIsDefined(*macroSourceFile) || !functionCheckSignature(*macroSourceFile, opaquePointerType, {}))
+          report_fatal_error("invalid definition of macro_source_file: macro_source_file must be a external function with the following signature (without name mangling): const char *macro_source_file(void)", false);
+      }
+      else if(!macroSourceLine && name == "macro_source_line")
+      {
+        macroSourceLine = &function;
+        if(functionIsDefined(*macroSourceLine) || !functionCheckSignature(*macroSourceLine, int32Type, {}))
+          report_fatal_error("invalid definition of macro_source_line: macro_source_line must be a external function with the following signature (without name mangling): unsigned macro_source_line(void)", false);
+      }
+      else if(!macroFunctionId && name == "macro_function_id")
+      {
+        macroFunctionId = &function;
+        if(functionIsDefined(*macroFunctionId) || !functionCheckSignature(*macroFunctionId, int64Type, {}))
+          report_fatal_error("invalid definition of macro_function_id: macro_function_id must be a external function with the following signature (without name mangling): uint64_t macro_function_id(void)", false);
+      }
+      else if(!macroArgCount && name == "macro_arg_count")
+      {
+        macroArgCount = &function;
+        if(functionIsDefined(*macroArgCount) || !functionCheckSignature(*macroArgCount, sizeType, {}))
+          report_fatal_error("invalid definition of macro_arg_count: macro_arg_count must be a external function with the following signature (without name mangling): size_t macro_arg_count(void)", false);
+      }
+      else if(!macroArgPtr && name == "macro_arg_ptr")
+      {
+        macroArgPtr = &function;
+        if(functionIsDefined(*macroArgPtr) || !functionCheckSignature(*macroArgPtr, opaquePointerType, {sizeType}))
+          report_fatal_error("invalid definition of macro_arg_ptr: macro_arg_ptr must be a external function with the following signature (without name mangling): void *macro_arg_ptr(size_t i)", false);
+      }
+      else if(!macroArgSize && name == "macro_arg_size")
+      {
+        macroArgSize = &function;
+        if(functionIsDefined(*macroArgSize) || !functionCheckSignature(*macroArgSize, sizeType, {sizeType}))
+          report_fatal_error("invalid definition of macro_arg_size: macro_arg_size must be a external function with the following signature (without name mangling): size_t macro_arg_size(size_t i)", false);
+      }
+      else if(!macroReturnPtr && name == "macro_return_ptr")
+      {
+        macroReturnPtr = &function;
+        if(functionIsDefined(*macroReturnPtr) || !functionCheckSignature(*macroReturnPtr, opaquePointerType, {}))
+          report_fatal_error("invalid definition of macro_return_ptr: macro_return_ptr must be a external function with the following signature (without name mangling): void *macro_return_ptr(void)", false);
+      }
+      else if(!macroUnlikely && name == "macro_unlikely")
+      {
+        macroUnlikely = &function;
+        if(functionIsDefined(*macroUnlikely) || !functionCheckSignature(*macroUnlikely, int32Type, {int32Type}))
+          report_fatal_error("invalid definition of macro_unlikely: macro_unlikely must be a external function with the following signature (without name mangling): int macro_unlikely(int condition)", false);
+      }
+      else if(!macroLoopTripCount && name == "macro_loop_trip_count")
+      {
+        macroLoopTripCount = &function;
+        if(functionIsDefined(*macroLoopTripCount) || !functionCheckSignature(*macroLoopTripCount, int64Type, {}))
+          report_fatal_error("invalid definition of macro_loop_trip_count: macro_loop_trip_count must be a external function with the following signature (without name mangling): uint64_t macro_loop_trip_count(void)", false);
+      }
+    }
+
+    if(optPercpuShards == 0 || !isPowerOf2_32(optPercpuShards))
+      report_fatal_error("-macro-percpu-shards must be a power of 2", false);
+
+    if(!macroDef && !macroDefCallSite && !macroDefLoop)
+      report_fatal_error("missing definition of void macro_def(void), void macro_def_callsite(void) or void macro_def_loop(void) (without name mangling)", false);
+
+    if(optHotPolicy == HotPolicy::Lightweight && (!macroDef || !macroDefHot))
+      report_fatal_error("-macro-hot-policy=lightweight requires definitions of both void macro_def(void) and void macro_def_hot(void) (without name mangling)", false);
+
+    if(optHotPercentile > 1000000)
+      report_fatal_error("-macro-hot-percentile must be at most 1000000", false);
+
+    if(macroUnlikely)
+      outlineColdRegions(macroFunctions, macroUnlikely, macroCall);
+
+    // Every loop outlined for macro_def_loop() stores its trip count into this
+    // variable before returning, so that it can be read by the macro right
+    // after macro_call(). With -macro-comdat, it is shared by all modules like
+    // the shared macro functions which read it.
+    GlobalVariable *tripCountVariable = nullptr;
+    if(macroLoopTripCount)
+    {
+      tripCountVariable = new GlobalVariable(module, int64Type, false, GlobalValue::InternalLinkage, ConstantInt::get(int64Type, 0), "macro.loop.trip_count");
+      tripCountVariable->setThreadLocal(true);
+      if(optComdat)
+      {
+        tripCountVariable->setLinkage(GlobalValue::LinkOnceODRLinkage);
+        tripCountVariable->setVisibility(GlobalValue::HiddenVisibility);
+        if(comdat)
+          tripCountVariable->setComdat(module.getOrInsertComdat(tripCountVariable->getName()));
+      }
+    }
+
+    startPhase("lower", "Clone the macro and lower its builtins");
+
+    Function *newMacroDef = nullptr;
+    Function *newMacroDefHot = nullptr;
+    Function *newMacroDefCallSite = nullptr;
+    Function *newMacroDefLoop = nullptr;
+
+    SmallDenseMap<Function *, Function *> macroFunctionsMap;
+    for(Function &function: macroFunctions)
+      if(functionIsDefined(function))
+      {
+        FunctionType *functionType = function.getFunctionType();
+
+        SmallVector<Type *> newParams;
+        newParams.push_back(opaquePointerType);
+        newParams.push_back(opaquePointerType);
+        newParams.push_back(sizeType);
+        newParams.insert(newParams.end(), functionType->param_begin(), functionType->param_end());
+
+        FunctionType *newFunctionType = FunctionType::get(functionType->getReturnType(), newParams, functionType->isVarArg());
+        Function *newFunction = Function::Create(newFunctionType, GlobalValue::LinkageTypes::InternalLinkage, function.getName() + ".clone", module);
+
+        ValueToValueMapTy VMap;
+        for(size_t i=0; i<function.arg_size(); ++i)
+          VMap.insert({ function.getArg(i), newFunction->getArg(i+3) });
+
+        SmallVector<ReturnInst *> Returns;
+        CloneFunctionInto(newFunction, &function, VMap, CloneFunctionChangeType::LocalChangesOnly, Returns);
+
+        macroFunctionsMap.insert({&function, newFunction});
+        if(&function == macroDef)
+          newMacroDef = newFunction;
+        else if(&function == macroDefHot)
+          newMacroDefHot = newFunction;
+        else if(&function == macroDefCallSite)
+          newMacroDefCallSite = newFunction;
+        else if(&function == macroDefLoop)
+          newMacroDefLoop = newFunction;
+
+        // The original macro functions are never called.
+        if(function.hasExternalLinkage())
+          function.setLinkage(GlobalValue::InternalLinkage);
+      }
+
+    // We have already found a definition for macro_def(),
+    // macro_def_callsite() or macro_def_loop() above (or else we would have
+    // erred out) so this should never happen.
+    assert(newMacroDef || newMacroDefCallSite || newMacroDefLoop);
+
+    SmallPtrSet<Function *, 16> macroClones;
+    for(auto [function, newFunction]: macroFunctionsMap)
+      macroClones.insert(newFunction);
+
+    SmallDenseMap<uint64_t, ArraySpec> arraySpecs;
+
+    // Calls to storage builtins are rewritten to refer to their storage
+    // directly once all ids are known. The index is null for the builtins
+    // returning the whole array and the shard is null unless given explicitly
+    // to macro_local_percpu_shard_ptr().
+    struct ArrayCall
+    {
+      CallInst *callInstr;
+      uint64_t id;
+      Value *index;
+      Value *shard;
+    };
+
+    SmallVector<ArrayCall> arrayCalls;
+    SmallDenseSet<uint64_t> arrayIds;
+
+    // Calls to descriptor builtins are rewritten to load the given field from
+    // the descriptor of the wrapped function once all of them are known.
+    struct DescriptorCall
+    {
+      CallInst *callInstr;
+      unsigned field;
+      Value *index;
+    };
+
+    SmallVector<DescriptorCall> descriptorCalls;
+
+    // Calls to argument builtins are rewritten to look up the location of the
+    // argument in the lambda context from the descriptor.
+    struct ArgumentCall
+    {
+      enum Kind
+      {
+        Count,
+        Pointer,
+        Size,
+        Return,
+      };
+
+      CallInst *callInstr;
+      Kind kind;
+      Value *index;
+      Value *context;
+      Value *arg;
+    };
+
+    SmallVector<ArgumentCall> argumentCalls;
+
+    FunctionType *lambdaFunctionType = FunctionType::get(voidType, opaquePointerType, false);
+
+    for(auto [function, newFunction]: macroFunctionsMap)
+    {
+      for(BasicBlock &block : *function)
+        for(Instruction &instr : make_early_inc_range(make_range(block.begin(), --block.end())))
+          if(CallInst *callInstr = dyn_cast<CallInst>(&instr))
+          {
+            Function *calledFunction = callInstr->getCalledFunction();
+            if(calledFunction == macroCall)
+            {
+              IRBuilder<> builder(callInstr);
+
+              CallInst *newCallInstr = builder.CreateIntrinsic(Intrinsic::trap, {}, {});
+              callInstr->replaceAllUsesWith(newCallInstr);
+              callInstr->eraseFromParent();
+            }
+            else if(calledFunction == macroIndex)
+            {
+              IRBuilder<> builder(callInstr);
+
+              CallInst *newCallInstr = builder.CreateIntrinsic(Intrinsic::trap, {}, {});
+              callInstr->replaceAllUsesWith(builder.getIntN(sizeWidth, 0));
+              callInstr->eraseFromParent();
+            }
+            else if(calledFunction == macroLocalPtr || calledFunction == macroTlsArray || calledFunction == macroLocalTlsPtr || calledFunction == macroLocalPercpuPtr || calledFunction == macroLocalPercpuShardPtr || calledFunction == macroFunctionName || calledFunction == macroSourceFile || calledFunction == macroArgPtr || calledFunction == macroReturnPtr)
+            {
+              IRBuilder<> builder(callInstr);
+
+              CallInst *newCallInstr = builder.CreateIntrinsic(Intrinsic::trap, {}, {});
+              callInstr->replaceAllUsesWith(ConstantPointerNull::get(opaquePointerType));
+              callInstr->eraseFromParent();
+            }
+            else if(calledFunction == macroSourceLine || calledFunction == macroFunctionId || calledFunction == macroArgCount || calledFunction == macroArgSize || calledFunction == macroLoopTripCount)
+            {
+              IRBuilder<> builder(callInstr);
+
+              CallInst *newCallInstr = builder.CreateIntrinsic(Intrinsic::trap, {}, {});
+              callInstr->replaceAllUsesWith(ConstantInt::get(calledFunction->getReturnType(), 0));
+              callInstr->eraseFromParent();
+            }
+            else if(calledFunction == macroPercpuCount)
+            {
+              callInstr->replaceAllUsesWith(ConstantInt::get(sizeType, optPercpuShards));
+              callInstr->eraseFromParent();
+            }
+          }
+
+      for(BasicBlock &block : *newFunction)
+      {
+        Value *lambdaFunction = newFunction->getArg(0);
+        Value *lambdaContext = newFunction->getArg(1);
+        Value *lambdaIndex = newFunction->getArg(2);
+
+        for(Instruction &instr : make_early_inc_range(make_range(block.begin(), --block.end())))
+          if(CallInst *callInstr = dyn_cast<CallInst>(&instr))
+          {
+            Function *calledFunction = callInstr->getCalledFunction();
+            if(calledFunction == macroCall)
+            {
+              IRBuilder<> builder(callInstr);
+
+              CallInst *newCallInstr = builder.CreateCall(lambdaFunctionType, lambdaFunction, lambdaContext);
+              callInstr->replaceAllUsesWith(newCallInstr);
+              callInstr->eraseFromParent();
+            }
+            else if(calledFunction == macroIndex)
+            {
+              callInstr->replaceAllUsesWith(lambdaIndex);
+              callInstr->eraseFromParent();
+            }
+            else if(calledFunction == macroArray || calledFunction == macroLocalPtr || calledFunction == macroTlsArray || calledFunction == macroLocalTlsPtr || calledFunction == macroLocalPercpuPtr || calledFunction == macroLocalPercpuShardPtr)
+            {
+              StringRef signature;
+              ArraySpec arraySpec;
+              Value *index = lambdaIndex;
+              Value *shard = nullptr;
+              if(calledFunction == macroArray)
+              {
+                signature = "void *macro_array(size_t id, size_t size, size_t alignment)";
+                arraySpec.storage = StorageClass::Static;
+                index = nullptr;
+              }
+              else if(calledFunction == macroLocalPtr)
+              {
+                signature = "void *macro_local_ptr(size_t id, size_t size, size_t alignment)";
+                arraySpec.storage = StorageClass::Static;
+              }
+              else if(calledFunction == macroTlsArray)
+              {
+                signature = "void *macro_tls_array(size_t id, size_t size, size_t alignment)";
+                arraySpec.storage = StorageClass::ThreadLocal;
+                index = nullptr;
+              }
+              else if(calledFunction == macroLocalTlsPtr)
+              {
+                signature = "void *macro_local_tls_ptr(size_t id, size_t size, size_t alignment)";
+                arraySpec.storage = StorageClass::ThreadLocal;
+              }
+              else if(calledFunction == macroLocalPercpuPtr)
+              {
+                signature = "void *macro_local_percpu_ptr(size_t id, size_t size, size_t alignment)";
+                arraySpec.storage = StorageClass::PerCPU;
+              }
+              else
+              {
+                signature = "void *macro_local_percpu_shard_ptr(size_t id, size_t size, size_t alignment, size_t shard)";
+                arraySpec.storage = StorageClass::PerCPU;
+                shard = callInstr->getArgOperand(3);
+              }
+
+              uint64_t id = arrayCallSpec(callInstr, signature, arraySpec);
+
+              auto [it, success] = arraySpecs.insert({id, arraySpec});
+              if(!success && (it->second.size != arraySpec.size || it->second.alignment != arraySpec.alignment || it->second.storage != arraySpec.storage))
+                report_fatal_error("multiple call to " + signature + " with same id but different size, alignment or storage class");
+
+              if(!index)
+                arrayIds.insert(id);
+
+              arrayCalls.push_back({ callInstr, id, index, shard });
+            }
+            else if(calledFunction == macroPercpuCount)
+            {
+              callInstr->replaceAllUsesWith(ConstantInt::get(sizeType, optPercpuShards));
+              callInstr->eraseFromParent();
+            }
+            else if(calledFunction == macroFunctionName)
+              descriptorCalls.push_back({ callInstr, 0, lambdaIndex });
+            else if(calledFunction == macroSourceFile)
+              descriptorCalls.push_back({ callInstr, 1, lambdaIndex });
+            else if(calledFunction == macroSourceLine)
+              descriptorCalls.push_back({ callInstr, 2, lambdaIndex });
+            else if(calledFunction == macroFunctionId)
+              descriptorCalls.push_back({ callInstr, 4, lambdaIndex });
+            else if(calledFunction == macroArgCount)
+              argumentCalls.push_back({ callInstr, ArgumentCall::Count, lambdaIndex, lambdaContext, nullptr });
+            else if(calledFunction == macroArgPtr)
+              argumentCalls.push_back({ callInstr, ArgumentCall::Pointer, lambdaIndex, lambdaContext, callInstr->getArgOperand(0) });
+            else if(calledFunction == macroArgSize)
+              argumentCalls.push_back({ callInstr, ArgumentCall::Size, lambdaIndex, lambdaContext, callInstr->getArgOperand(0) });
+            else if(calledFunction == macroReturnPtr)
+              argumentCalls.push_back({ callInstr, ArgumentCall::Return, lambdaIndex, lambdaContext, nullptr });
+            else if(calledFunction == macroLoopTripCount)
+            {
+              IRBuilder<> builder(callInstr);
+
+              callInstr->replaceAllUsesWith(builder.CreateLoad(int64Type, builder.CreateThreadLocalAddress(tripCountVariable)));
+              callInstr->eraseFromParent();
+            }
+            else if(auto it = macroFunctionsMap.find(calledFunction); it != macroFunctionsMap.end())
+            {
+              IRBuilder<> builder(callInstr);
+
+              SmallVector<Value *> newArgs;
+              newArgs.push_back(lambdaFunction);
+              newArgs.push_back(lambdaContext);
+              newArgs.push_back(lambdaIndex);
+              newArgs.insert(newArgs.end(), callInstr->arg_begin(), callInstr->arg_end());
+
+              CallInst *newCallInstr = builder.CreateCall(it->second->getFunctionType(), it->second, newArgs);
+              callInstr->replaceAllUsesWith(newCallInstr);
+              callInstr->eraseFromParent();
+            }
+          }
+      }
+    }
+
+    ///////////////////////////////////////////////////
+    // Select the functions to expand the macro into //
+    ///////////////////////////////////////////////////
+    SmallVector<ExpansionReport> functionReports;
+    SmallVector<ExpansionReport> callSiteReports;
+    SmallVector<ExpansionReport> loopReports;
+    SmallDenseMap<Function *, size_t> functionReportIndices;
+
+    // With a profile, functions whose entry count is in the hottest percentile
+    // are treated according to -macro-hot-policy. The entry count is what
+    // matters rather than hot loops inside the function, since the macro is
+    // run once per call.
+    ProfileSummaryInfo &profileSummary = moduleAnalysisManager.getResult<ProfileSummaryAnalysis>(module);
+    SmallPtrSet<Function *, 16> hotFunctions;
+    auto isHot = [&](Function &function) {
+      if(!profileSummary.hasProfileSummary())
+        return false;
+
+      std::optional<Function::ProfileCount> entryCount = function.getEntryCount();
+      return entryCount && profileSummary.isHotCountNthPercentile(optHotPercentile, entryCount->getCount());
+    };
+
+    SmallVector<std::reference_wrapper<Function>> selectedFunctions;
+    if(newMacroDef)
+      for(Function &function: mainFunctions)
+        if(functionIsDefined(function))
+        {
+          StringRef skipReason = functionSelector.skipReason(function);
+          bool hot = isHot(function);
+          if(hot)
+          {
+            ++NumHotFunctions;
+            if(skipReason.empty() && optHotPolicy == HotPolicy::Skip)
+              skipReason = "hot";
+          }
+
+          unsigned instructionCount = function.getInstructionCount();
+          functionReports.push_back({ .name = function.getName().str(), .skipReason = skipReason, .hot = hot, .instructionsBefore = instructionCount, });
+          if(!skipReason.empty())
+          {
+            ++NumFunctionsSkipped;
+            continue;
+          }
+
+          functionReportIndices.insert({&function, functionReports.size() - 1});
+          NumInstructionsBefore += instructionCount;
+          selectedFunctions.push_back(function);
+          if(hot)
+            hotFunctions.insert(&function);
+        }
+
+    // Call sites get their indices after every wrapped function.
+    SmallVector<CallBase *> selectedCallSites;
+    if(newMacroDefCallSite)
+      for(Function &function: mainFunctions)
+        if(functionIsDefined(function) && !function.hasFnAttribute(Attribute::Naked))
+          for(Instruction &instr: instructions(function))
+            if(CallBase *callInstr = dyn_cast<CallBase>(&instr); callInstr && functionSelector.isSelectedCallSite(*callInstr))
+              selectedCallSites.push_back(callInstr);
+
+    // Loops get their indices after every call site. Every selected loop is
+    // outlined into a function of its own, around the call to which the macro
+    // is then expanded as around a call site. Loops are selected within the
+    // functions the macro would be expanded into, and call sites inside them
+    // move along into the outlined function.
+    SmallVector<CallBase *> selectedLoops;
+    if(newMacroDefLoop)
+    {
+      FunctionAnalysisManager &functionAnalysisManager = moduleAnalysisManager.getResult<FunctionAnalysisManagerModuleProxy>(module).getManager();
+      for(Function &function: mainFunctions)
+        if(functionIsDefined(function) && functionSelector.skipReason(function).empty())
+          outlineLoops(function, functionAnalysisManager, tripCountVariable, selectedLoops);
+    }
+
+    size_t lambdaTotal = selectedFunctions.size() + selectedCallSites.size() + selectedLoops.size();
+    NumFunctionsWrapped += selectedFunctions.size();
+    NumCallSitesWrapped += selectedCallSites.size();
+    NumLoopsWrapped += selectedLoops.size();
+    NumMacroFunctionsCloned += macroFunctionsMap.size();
+
+    ///////////////////////////////////////////////////
+    // Describe the wrapped functions and call sites //
+    ///////////////////////////////////////////////////
+    //
+    // Every function and call site the macro is expanded into gets a constant
+    // descriptor of type
+    //
+    //   struct macro_descriptor
+    //   {
+    //     const char *name; const char *file; unsigned line; unsigned kind; uint64_t id;
+    //     const struct macro_slot { uint32_t offset; uint32_t size; } *slots; unsigned arg_count; unsigned context_size;
+    //     unsigned char *enable;
+    //   };
+    //
+    // (see macro_runtime.h) indexed by macro_index(). The descriptors are
+    // placed into the __macro_descriptors section on ELF targets so that the
+    // runtime can walk the descriptors of the whole program, in which case
+    // they are also indexed by macro_index() with -macro-index-scope=program.
+    //
+    // The slots give the location of every argument followed by the return
+    // value in the lambda context, and are only known once the lambdas have
+    // been created, so the descriptors are only filled in at the end. enable
+    // points to the enable flag of wrapped functions with -macro-enable, which
+    // numbers only functions, and is null otherwise.
+    StructType *slotType = StructType::get(context, { int32Type, int32Type });
+    StructType *descriptorType = StructType::get(context, { opaquePointerType, opaquePointerType, int32Type, int32Type, int64Type, opaquePointerType, int32Type, int32Type, opaquePointerType });
+
+    GlobalVariable *descriptorsVariable = nullptr;
+    SmallVector<SmallVector<Constant *, 8>> descriptorFields;
+    bool argumentAccess = !argumentCalls.empty();
+    if(!descriptorCalls.empty() || argumentAccess || (optDescriptors && lambdaTotal != 0))
+    {
+      auto sourceFile = [&](DIScope *scope) -> std::string {
+        if(!scope)
+          return module.getSourceFileName();
+
+        SmallString<128> path(scope->getFilename());
+        if(!scope->getDirectory().empty() && !sys::path::is_absolute(path))
+        {
+          path = scope->getDirectory();
+          sys::path::append(path, scope->getFilename());
+        }
+        return std::string(path);
+      };
+
+      IRBuilder<> stringBuilder(context);
+      auto describe = [&](StringRef name, DIScope *scope, unsigned line, unsigned kind, uint64_t id) {
+        descriptorFields.push_back({
+          stringBuilder.CreateGlobalStringPtr(name, "", 0, &module),
+          stringBuilder.CreateGlobalStringPtr(sourceFile(scope), "", 0, &module),
+          ConstantInt::get(int32Type, line),
+          ConstantInt::get(int32Type, kind),
+          ConstantInt::get(int64Type, id),
+        });
+      };
+
+      // The id of a function is the MD5 hash of its mangled name, as used by
+      // LLVM for profile data, so that it is stable across builds. Call sites
+      // hash the caller and the callee instead, and loops are named after the
+      // function they are outlined into.
+      for(Function &function: selectedFunctions)
+      {
+        DISubprogram *subprogram = function.getSubprogram();
+        describe(function.getName(), subprogram, subprogram ? subprogram->getLine() : 0, 0, MD5Hash(function.getName()));
+      }
+
+      for(CallBase *callInstr: selectedCallSites)
+      {
+        StringRef calleeName = callInstr->getCalledFunction()->getName();
+        const DebugLoc &debugLoc = callInstr->getDebugLoc();
+        DIScope *scope = debugLoc ? debugLoc->getScope() : callInstr->getFunction()->getSubprogram();
+        describe(calleeName, scope, debugLoc ? debugLoc.getLine() : 0, 1, MD5Hash((callInstr->getFunction()->getName() + ";" + calleeName).str()));
+      }
+
+      for(CallBase *callInstr: selectedLoops)
+      {
+        StringRef loopName = callInstr->getCalledFunction()->getName();
+        const DebugLoc &debugLoc = callInstr->getDebugLoc();
+        DIScope *scope = debugLoc ? debugLoc->getScope() : callInstr->getFunction()->getSubprogram();
+        describe(loopName, scope, debugLoc ? debugLoc.getLine() : 0, 2, MD5Hash(loopName));
+      }
+
+      ArrayType *descriptorsType = ArrayType::get(descriptorType, lambdaTotal);
+      descriptorsVariable = new GlobalVariable(module, descriptorsType, true, GlobalValue::InternalLinkage, nullptr, "macro.descriptors");
+
+      Constant *descriptorsBase = descriptorsVariable;
+      if(Triple(module.getTargetTriple()).isOSBinFormatELF())
+      {
+        descriptorsVariable->setSection("__macro_descriptors");
+        descriptorsVariable->setAlignment(dataLayout.getABITypeAlign(descriptorType));
+        appendToUsed(module, descriptorsVariable);
+        if(programScope)
+          descriptorsBase = sectionBoundary(module, "__macro_descriptors", false);
+      }
+
+      for(auto [callInstr, field, index]: descriptorCalls)
+      {
+        IRBuilder<> builder(callInstr);
+
+        Value *fieldPointer = builder.CreateInBoundsGEP(descriptorType, descriptorsBase, { index, builder.getInt32(field) });
+        Value *fieldValue = builder.CreateLoad(descriptorType->getElementType(field), fieldPointer);
+        callInstr->replaceAllUsesWith(fieldValue);
+        callInstr->eraseFromParent();
+      }
+
+      for(auto [callInstr, kind, index, lambdaContext, arg]: argumentCalls)
+      {
+        IRBuilder<> builder(callInstr);
+
+        Value *descriptor = builder.CreateInBoundsGEP(descriptorType, descriptorsBase, index);
+        Value *argCount = builder.CreateZExt(builder.CreateLoad(int32Type, builder.CreateStructGEP(descriptorType, descriptor, 6)), sizeType);
+
+        Value *result;
+        if(kind == ArgumentCall::Count)
+          result = argCount;
+        else
+        {
+          Value *slots = builder.CreateLoad(opaquePointerType, builder.CreateStructGEP(descriptorType, descriptor, 5));
+          Value *slot = builder.CreateInBoundsGEP(slotType, slots, kind == ArgumentCall::Return ? argCount : arg);
+          Value *slotOffset = builder.CreateLoad(int32Type, builder.CreateStructGEP(slotType, slot, 0));
+          Value *slotSize = builder.CreateZExt(builder.CreateLoad(int32Type, builder.CreateStructGEP(slotType, slot, 1)), sizeType);
+
+          Value *slotPointer = builder.CreateInBoundsGEP(int8Type, lambdaContext, slotOffset);
+          switch(kind)
+          {
+          case ArgumentCall::Size:
+            result = slotSize;
+            break;
+          case ArgumentCall::Pointer:
+            result = slotPointer;
+            break;
+          default:
+            result = builder.CreateSelect(builder.CreateICmpEQ(slotSize, ConstantInt::get(sizeType, 0)), ConstantPointerNull::get(opaquePointerType), slotPointer);
+            break;
+          }
+        }
+
+        callInstr->replaceAllUsesWith(result);
+        callInstr->eraseFromParent();
+      }
+    }
+
+    // Record where the arguments and the return value of a lambda are stored
+    // in its context. The slots are only emitted if the macro accesses them.
+    auto describeLambdaContext = [&](size_t lambdaNumber, StructType *lambdaContextType, ArrayRef<int> argIndices, int returnStorageIndex) {
+      if(!descriptorsVariable)
+        return;
+
+      const StructLayout *layout = dataLayout.getStructLayout(lambdaContextType);
+      Constant *slotsPointer = ConstantPointerNull::get(opaquePointerType);
+      if(argumentAccess)
+      {
+        SmallVector<Constant *> slots;
+        auto addSlot = [&](int index) {
+          uint64_t offset = index < 0 ? 0 : layout->getElementOffset(index);
+          uint64_t size = index < 0 ? 0 : dataLayout.getTypeStoreSize(lambdaContextType->getElementType(index));
+          slots.push_back(ConstantStruct::get(slotType, { ConstantInt::get(int32Type, offset), ConstantInt::get(int32Type, size) }));
+        };
+
+        for(int index: argIndices)
+          addSlot(index);
+
+        addSlot(returnStorageIndex);
+
+        ArrayType *slotsType = ArrayType::get(slotType, slots.size());
+        GlobalVariable *slotsVariable = new GlobalVariable(module, slotsType, true, GlobalValue::PrivateLinkage, ConstantArray::get(slotsType, slots), "macro.slots");
+        slotsVariable->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+        slotsPointer = slotsVariable;
+      }
+
+      SmallVector<Constant *, 8> &fields = descriptorFields[lambdaNumber];
+      fields.push_back(slotsPointer);
+      fields.push_back(ConstantInt::get(int32Type, argIndices.size()));
+      fields.push_back(ConstantInt::get(int32Type, layout->getSizeInBytes()));
+    };
+
+    startPhase("layout", "Lay out the storage of macro local variables");
+
+    //////////////////////////////////////////////////
+    // Lay out the storage of macro local variables //
+    //////////////////////////////////////////////////
+    //
+    // Every id is backed by an array with one element per wrapped function,
+    // except with -macro-local-layout=aos in which case ids only ever accessed
+    // through macro_local_*ptr() are packed into a record per function
+    // instead. Every storage class has its own arrays and records, and per-CPU
+    // storage is replicated once per shard with every shard starting on its
+    // own cache line.
+    const uint64_t cacheLineSize = 64;
+
+    struct Storage
+    {
+      SmallDenseMap<uint64_t, Constant *> arrayBases;
+      SmallDenseMap<uint64_t, uint64_t> arrayStrides;
+
+      SmallDenseMap<uint64_t, uint64_t> recordOffsets;
+      uint64_t recordSize = 0;
+      uint64_t recordAlignment = cacheLineSize;
+      uint64_t recordStride = 0;
+      Constant *recordBase = nullptr;
+
+      // Tables of pointers to the slab of every function, for ids backed by
+      // slabs allocated on first use.
+      SmallDenseMap<uint64_t, Constant *> slabTables;
+    };
+
+    std::array<Storage, 3> storages;
+    auto storageFor = [&](StorageClass storageClass) -> Storage & {
+      return storages[static_cast<size_t>(storageClass)];
+    };
+
+    // Return the base address of the storage, which is the start of the
+    // section the storage of every module is placed into with
+    // -macro-index-scope=program. The stride between shards is returned for
+    // per-CPU storage.
+    uint64_t storageBytes = 0;
+    SmallVector<StorageReport> storageReports;
+
+    // Sizes of storage must fit into the address space of the target, since
+    // they are indexed with size_t.
+    uint64_t maxStorageSize = maxUIntN(sizeWidth);
+    auto checkedStorageSize = [&](uint64_t count, uint64_t size, const Twine &name) -> uint64_t {
+      bool overflow = false;
+      uint64_t total = SaturatingMultiply(count, size, &overflow);
+      if(overflow || total > maxStorageSize)
+        report_fatal_error("storage of " + name + " is too large: " + Twine(count) + " x " + Twine(size) + " bytes", false);
+      return total;
+    };
+
+    auto createStorage = [&](StorageClass storageClass, const Twine &name, StringRef section, uint64_t size, uint64_t alignment, uint64_t &stride) -> Constant * {
+      uint64_t shards = 1;
+      stride = size;
+      if(storageClass == StorageClass::PerCPU)
+      {
+        if(size > maxStorageSize - (cacheLineSize - 1))
+          report_fatal_error("storage of " + name + " is too large: " + Twine(size) + " bytes", false);
+
+        shards = optPercpuShards;
+        stride = alignTo(size, cacheLineSize);
+        alignment = std::max(alignment, cacheLineSize);
+      }
+
+      ArrayType *arrayType = ArrayType::get(int8Type, checkedStorageSize(shards, stride, name));
+      storageBytes += stride * shards;
+      GlobalVariable *globalVariable = new GlobalVariable(module, arrayType, false, GlobalValue::InternalLinkage, ConstantAggregateZero::get(arrayType), name);
+      globalVariable->setAlignment(Align(alignment));
+      globalVariable->setThreadLocal(storageClass == StorageClass::ThreadLocal);
+
+      if(!programScope)
+        return globalVariable;
+
+      // Since size is a multiple of alignment, the linker does not need to
+      // insert any padding between contributions of each module to the
+      // section.
+      globalVariable->setSection(section);
+      appendToUsed(module, globalVariable);
+      return sectionBoundary(module, section, false);
+    };
+
+    SmallVector<uint64_t> ids;
+    for(auto&& [id, arraySpec]: arraySpecs)
+      ids.push_back(id);
+    sort(ids);
+
+    for(uint64_t id: ids)
+    {
+      const ArraySpec &arraySpec = arraySpecs[id];
+      if(programScope && arraySpec.storage != StorageClass::Static)
+        report_fatal_error("thread local and per-CPU macro local variables are not supported with -macro-index-scope=program", false);
+
+      // Large static macro local variables are only allocated for the
+      // functions which actually use them, so that memory scales with the
+      // functions executed rather than those wrapped. Ids accessed with
+      // macro_array() must stay contiguous.
+      bool lazy = optLazyThreshold != 0 && arraySpec.storage == StorageClass::Static && arraySpec.size >= optLazyThreshold && !arrayIds.contains(id);
+
+      storageReports.push_back({ .id = id, .storageClass = arraySpec.storage, .size = arraySpec.size, .alignment = arraySpec.alignment, .lazy = lazy, });
+      ++NumStorageIds;
+
+      Storage &storage = storageFor(arraySpec.storage);
+      if(lazy)
+      {
+        if(alignTo(arraySpec.size, arraySpec.alignment) > maxStorageSize)
+          report_fatal_error("storage of macro local variable " + Twine(id) + " is too large: " + Twine(arraySpec.size) + " bytes", false);
+
+        uint64_t pointerSize = dataLayout.getPointerSize();
+        std::string name = "macro_slabs." + utostr(id);
+        uint64_t stride;
+        storage.slabTables.insert({id, createStorage(StorageClass::Static, name, "__macro_slabs_" + utostr(id), checkedStorageSize(lambdaTotal, pointerSize, name), pointerSize, stride)});
+        continue;
+      }
+
+      if(optLocalLayout == LocalLayout::AoS && !arrayIds.contains(id))
+      {
+        uint64_t offset = alignTo(storage.recordSize, arraySpec.alignment);
+        if(offset < storage.recordSize || arraySpec.size > maxStorageSize - offset)
+          report_fatal_error("storage of macro local variable " + Twine(id) + " is too large: " + Twine(arraySpec.size) + " bytes at offset " + Twine(storage.recordSize), false);
+
+        storage.recordOffsets.insert({id, offset});
+        storage.recordSize = offset + arraySpec.size;
+        storage.recordAlignment = std::max(storage.recordAlignment, arraySpec.alignment);
+        continue;
+      }
+
+      StringRef prefix;
+      switch(arraySpec.storage)
+      {
+      case StorageClass::Static:      prefix = "macro_array"; break;
+      case StorageClass::ThreadLocal: prefix = "macro_tls_array"; break;
+      case StorageClass::PerCPU:      prefix = "macro_percpu_array"; break;
+      }
+
+      std::string name = (prefix + "." + utostr(id)).str();
+      uint64_t stride;
+      storage.arrayBases.insert({id, createStorage(arraySpec.storage, name, ("__" + prefix + "_" + utostr(id)).str(), checkedStorageSize(lambdaTotal, arraySpec.size, name), arraySpec.alignment, stride)});
+      storage.arrayStrides.insert({id, stride});
+    }
+
+    for(StorageClass storageClass: {StorageClass::Static, StorageClass::ThreadLocal, StorageClass::PerCPU})
+    {
+      Storage &storage = storageFor(storageClass);
+      if(storage.recordOffsets.empty())
+        continue;
+
+      StringRef name;
+      switch(storageClass)
+      {
+      case StorageClass::Static:      name = "macro_locals"; break;
+      case StorageClass::ThreadLocal: name = "macro_tls_locals"; break;
+      case StorageClass::PerCPU:      name = "macro_percpu_locals"; break;
+      }
+
+      if(storage.recordSize > maxStorageSize - (storage.recordAlignment - 1))
+        report_fatal_error("storage of " + name + " is too large: " + Twine(storage.recordSize) + " bytes", false);
+
+      storage.recordSize = alignTo(storage.recordSize, storage.recordAlignment);
+      storage.recordBase = createStorage(storageClass, name, ("__" + name).str(), checkedStorageSize(lambdaTotal, storage.recordSize, name), storage.recordAlignment, storage.recordStride);
+    }
+
+    // The slab of a function is looked up in its table, and allocated and
+    // zeroed on first use. Concurrent first uses race to install their slab
+    // with a compare and exchange, and the losers free theirs.
+    Function *slabFunction = nullptr;
+    auto getSlabFunction = [&]() -> Function * {
+      if(slabFunction)
+        return slabFunction;
+
+      FunctionType *slabFunctionType = FunctionType::get(opaquePointerType, { opaquePointerType, sizeType, sizeType }, false);
+      slabFunction = Function::Create(slabFunctionType, GlobalValue::InternalLinkage, "macro.slab", module);
+      Function *allocFunction = Function::Create(slabFunctionType, GlobalValue::InternalLinkage, "macro.slab.alloc", module);
+      allocFunction->addFnAttr(Attribute::Cold);
+      allocFunction->addFnAttr(Attribute::NoInline);
+
+      Align pointerAlignment = dataLayout.getPointerABIAlignment(0);
+      {
+        BasicBlock *entryBlock = BasicBlock::Create(context, "", slabFunction);
+        BasicBlock *allocBlock = BasicBlock::Create(context, "", slabFunction);
+        BasicBlock *returnBlock = BasicBlock::Create(context, "", slabFunction);
+
+        IRBuilder<> builder(entryBlock);
+        LoadInst *slab = builder.CreateLoad(opaquePointerType, slabFunction->getArg(0));
+        slab->setAtomic(AtomicOrdering::Acquire);
+        slab->setAlignment(pointerAlignment);
+        builder.CreateCondBr(builder.CreateIsNull(slab), allocBlock, returnBlock, MDBuilder(context).createBranchWeights(1, 2000));
+
+        builder.SetInsertPoint(allocBlock);
+        builder.CreateRet(builder.CreateCall(allocFunction, { slabFunction->getArg(0), slabFunction->getArg(1), slabFunction->getArg(2) }));
+
+        builder.SetInsertPoint(returnBlock);
+        builder.CreateRet(slab);
+      }
+      {
+        BasicBlock *entryBlock = BasicBlock::Create(context, "", allocFunction);
+        BasicBlock *failedBlock = BasicBlock::Create(context, "", allocFunction);
+        BasicBlock *installBlock = BasicBlock::Create(context, "", allocFunction);
+        BasicBlock *lostBlock = BasicBlock::Create(context, "", allocFunction);
+        BasicBlock *wonBlock = BasicBlock::Create(context, "", allocFunction);
+
+        Value *slot = allocFunction->getArg(0);
+        Value *alignment = allocFunction->getArg(2);
+
+        // aligned_alloc() requires the size to be a multiple of the alignment.
+        IRBuilder<> builder(entryBlock);
+        Value *size = builder.CreateAnd(builder.CreateAdd(allocFunction->getArg(1), builder.CreateSub(alignment, builder.getIntN(sizeWidth, 1))), builder.CreateNeg(alignment));
+        FunctionCallee alignedAllocFunction = module.getOrInsertFunction("aligned_alloc", FunctionType::get(opaquePointerType, { sizeType, sizeType }, false));
+        Value *newSlab = builder.CreateCall(alignedAllocFunction, { alignment, size });
+        builder.CreateCondBr(builder.CreateIsNull(newSlab), failedBlock, installBlock);
+
+        builder.SetInsertPoint(failedBlock);
+        FunctionCallee abortFunction = module.getOrInsertFunction("abort", FunctionType::get(voidType, false));
+        builder.CreateCall(abortFunction);
+        builder.CreateUnreachable();
+
+        builder.SetInsertPoint(installBlock);
+        builder.CreateMemSet(newSlab, builder.getInt8(0), size, MaybeAlign());
+        AtomicCmpXchgInst *cmpXchg = builder.CreateAtomicCmpXchg(slot, ConstantPointerNull::get(opaquePointerType), newSlab, pointerAlignment, AtomicOrdering::AcquireRelease, AtomicOrdering::Acquire);
+        builder.CreateCondBr(builder.CreateExtractValue(cmpXchg, 1), wonBlock, lostBlock);
+
+        builder.SetInsertPoint(lostBlock);
+        FunctionCallee freeFunction = module.getOrInsertFunction("free", FunctionType::get(voidType, { opaquePointerType }, false));
+        builder.CreateCall(freeFunction, { newSlab });
+        builder.CreateRet(builder.CreateExtractValue(cmpXchg, 0));
+
+        builder.SetInsertPoint(wonBlock);
+        builder.CreateRet(newSlab);
+      }
+      return slabFunction;
+    };
+
+    for(auto [callInstr, id, index, shard]: arrayCalls)
+    {
+      const ArraySpec &arraySpec = arraySpecs[id];
+      Storage &storage = storageFor(arraySpec.storage);
+
+      IRBuilder<> builder(callInstr);
+
+      auto storageAddress = [&](Constant *base) -> Value * {
+        if(arraySpec.storage == StorageClass::ThreadLocal)
+          return builder.CreateThreadLocalAddress(base);
+
+        return base;
+      };
+
+      Value *pointer;
+      if(!index)
+        pointer = storageAddress(storage.arrayBases[id]);
+      else if(auto slabIt = storage.slabTables.find(id); slabIt != storage.slabTables.end())
+      {
+        Value *slot = builder.CreateGEP(opaquePointerType, slabIt->second, index);
+        pointer = builder.CreateCall(getSlabFunction(), { slot, builder.getIntN(sizeWidth, arraySpec.size), builder.getIntN(sizeWidth, arraySpec.alignment) });
+      }
+      else
+      {
+        auto it = storage.recordOffsets.find(id);
+        bool inRecord = it != storage.recordOffsets.end();
+
+        Value *base = storageAddress(inRecord ? storage.recordBase : storage.arrayBases[id]);
+        if(arraySpec.storage == StorageClass::PerCPU)
+        {
+          // Note: sched_getcpu() is implemented on top of rseq or vDSO where
+          //       available and returns -1 on failure, which is masked into a
+          //       valid shard.
+          if(!shard)
+          {
+            FunctionCallee schedGetcpu = module.getOrInsertFunction("sched_getcpu", FunctionType::get(int32Type, false));
+            Value *cpu = builder.CreateZExtOrTrunc(builder.CreateCall(schedGetcpu), sizeType);
+            shard = builder.CreateAnd(cpu, builder.getIntN(sizeWidth, optPercpuShards - 1));
+          }
+
+          uint64_t stride = inRecord ? storage.recordStride : storage.arrayStrides[id];
+          base = builder.CreateGEP(ArrayType::get(int8Type, stride), base, shard);
+        }
+
+        if(inRecord)
+          pointer = builder.CreateGEP(ArrayType::get(int8Type, storage.recordSize), base, { index, builder.getIntN(sizeWidth, it->second) });
+        else
+          pointer = builder.CreateGEP(ArrayType::get(int8Type, arraySpec.size), base, index);
+      }
+
+      callInstr->replaceAllUsesWith(pointer);
+      callInstr->eraseFromParent();
+    }
+
+    // According to LLVM documentation
+    // https://llvm.org/docs/LangRef.html#variable-argument-handling-intrinsics,
+    // the type for va_list is { ptr } except in the case of Unix x86_64
+    // platforms in which case the type for va_list is { i32, i32, ptr, ptr }.
+    //
+    // FIXME: We check for whether we are on Unix by checking if we are not on
+    //        Windows. This is technically not correct but should work in most
+    //        of the cases.
+    Type *vaListType;
+    if(llvm::Triple triple(module.getTargetTriple()); triple.getArch() == Triple::ArchType::x86_64 && !triple.isOSWindows())
+      vaListType = StructType::get(context, { int32Type, int32Type, opaquePointerType, opaquePointerType, });
+    else
+      vaListType = StructType::get(context, opaquePointerType);
+
+    bool specialize = false;
+    switch(optSpecialize)
+    {
+    case SpecializeMode::Always:
+      specialize = true;
+      break;
+    case SpecializeMode::Small:
+      {
+        SmallPtrSet<Function *, 16> reachable;
+        for(Function *function: {newMacroDef, newMacroDefHot, newMacroDefCallSite, newMacroDefLoop})
+          if(function)
+            collectReachableFunctions(function, macroClones, reachable);
+
+        size_t instructionCount = 0;
+        for(Function *function: reachable)
+          instructionCount += function->getInstructionCount();
+
+        specialize = instructionCount <= optSpecializeThreshold;
+      }
+      break;
+    case SpecializeMode::Never:
+      break;
+    }
+
+    SmallPtrSet<Function *, 4> simpleMacros;
+    if(optLowering == Lowering::Auto)
+      for(Function *function: {newMacroDef, newMacroDefHot, newMacroDefCallSite, newMacroDefLoop})
+        if(function && isSimpleMacro(function, macroClones))
+          simpleMacros.insert(function);
+
+    // With -macro-index-scope=program, the index is only known once the linker
+    // has laid out the __macro_index section.
+    auto lambdaIndexFor = [&](size_t lambdaNumber) -> Constant * {
+      if(!programScope)
+        return ConstantInt::get(sizeType, lambdaNumber);
+
+      Constant *indexSlot = ConstantExpr::getGetElementPtr(int8Type, indexSlots, ConstantInt::get(sizeType, lambdaNumber));
+      return ConstantExpr::getSub(ConstantExpr::getPtrToInt(indexSlot, sizeType), ConstantExpr::getPtrToInt(indexStart, sizeType));
+    };
+
+    // State of a single expansion of the macro into a function or around a
+    // call site.
+    struct MacroExpansion
+    {
+      Function *macroDef;
+      Function *lambdaFunction;
+      Constant *lambdaIndex;
+
+      SmallDenseMap<Function *, Function *> specializations;
+      Function *specializedMacroDef = nullptr;
+      bool inlineMacro = false;
+    };
+
+    // Call the macro (or its specialization) for a lambda. Simple macros are
+    // always specialized, since they are inlined along with the lambda.
+    auto createMacroCall = [&](IRBuilder<> &builder, MacroExpansion &expansion, Value *lambdaContext, const Twine &suffix, InvokeInst *invokeInstr) -> CallBase * {
+      expansion.inlineMacro = simpleMacros.contains(expansion.macroDef) && isInlineViable(*expansion.lambdaFunction).isSuccess();
+      if(specialize || expansion.inlineMacro)
+      {
+        expansion.specializedMacroDef = specializeMacroFunction(expansion.macroDef, expansion.lambdaFunction, expansion.lambdaIndex, suffix, macroClones, expansion.specializations);
+        if(expansion.inlineMacro)
+        {
+          flattenLambdaCall(expansion.specializedMacroDef, expansion.lambdaFunction, expansion.specializations);
+
+          // Flattening only fails if the inliner refuses a function.
+          CallInst *lambdaCallInstr = expansion.lambdaFunction->hasOneUse() ? dyn_cast<CallInst>(expansion.lambdaFunction->user_back()) : nullptr;
+          if(!lambdaCallInstr || lambdaCallInstr->getFunction() != expansion.specializedMacroDef)
+            expansion.inlineMacro = false;
+        }
+
+        if(!specialize && !expansion.inlineMacro)
+        {
+          eraseSpecializations(expansion.specializations);
+          expansion.specializedMacroDef = nullptr;
+        }
+      }
+
+      // Calls to the macro need a location in functions with debug info, which
+      // also becomes the inlined-at location of the macro once inlined.
+      if(!builder.getCurrentDebugLocation())
+        if(DISubprogram *subprogram = builder.GetInsertBlock()->getParent()->getSubprogram())
+          builder.SetCurrentDebugLocation(DILocation::get(context, subprogram->getLine(), 0, subprogram));
+
+      Function *callee = expansion.macroDef;
+      SmallVector<Value *> args = {expansion.lambdaFunction, lambdaContext, expansion.lambdaIndex};
+      if(expansion.specializedMacroDef)
+      {
+        callee = expansion.specializedMacroDef;
+        args = {lambdaContext};
+      }
+
+      if(invokeInstr)
+        return builder.CreateInvoke(callee->getFunctionType(), callee, invokeInstr->getNormalDest(), invokeInstr->getUnwindDest(), args);
+
+      return builder.CreateCall(callee->getFunctionType(), callee, args);
+    };
+
+    // Inline the macro and then the lambda (which the macro now calls
+    // directly) into the caller, so that there is no extra stack frame left.
+    // The lambda context is promoted to registers by SROA.
+    auto inlineMacroCall = [&](MacroExpansion &expansion, CallBase *macroDefCallInstr) {
+      Function *function = macroDefCallInstr->getFunction();
+
+      InlineFunctionInfo inlineInfo;
+      if(!InlineFunction(*macroDefCallInstr, inlineInfo).isSuccess())
+        return;
+
+      ++NumExpansionsInlined;
+      expansion.specializations.erase(expansion.macroDef);
+      expansion.specializedMacroDef->eraseFromParent();
+      expansion.specializedMacroDef = nullptr;
+
+      CallBase *lambdaCallInstr = cast<CallBase>(expansion.lambdaFunction->user_back());
+      if(InlineFunction(*lambdaCallInstr, inlineInfo).isSuccess())
+      {
+        expansion.lambdaFunction->eraseFromParent();
+        expansion.lambdaFunction = nullptr;
+      }
+
+      // Unless specializing, calls to other macro functions go back to the
+      // shared clones. They never call the lambda since it is only called by
+      // the macro itself.
+      if(specialize)
+        return;
+
+      for(auto [macroFunction, specialization]: expansion.specializations)
+        for(User *user: make_early_inc_range(specialization->users()))
+          if(CallInst *callInstr = dyn_cast<CallInst>(user); callInstr && callInstr->getFunction() == function)
+          {
+            IRBuilder<> builder(callInstr);
+
+            SmallVector<Value *> newArgs;
+            newArgs.push_back(ConstantPointerNull::get(opaquePointerType));
+            newArgs.push_back(callInstr->getArgOperand(0));
+            newArgs.push_back(expansion.lambdaIndex);
+            newArgs.insert(newArgs.end(), callInstr->arg_begin() + 1, callInstr->arg_end());
+
+            CallInst *newCallInstr = builder.CreateCall(macroFunction->getFunctionType(), macroFunction, newArgs);
+            callInstr->replaceAllUsesWith(newCallInstr);
+            callInstr->eraseFromParent();
+          }
+
+      eraseSpecializations(expansion.specializations);
+    };
+
+    // Record how the macro was expanded, and the number of instructions of the
+    // lambda and specializations left afterwards.
+    auto reportExpansion = [&](ExpansionReport &report, const MacroExpansion &expansion) {
+      if(expansion.specializedMacroDef)
+        report.lowering = "specialized";
+      else if(expansion.inlineMacro)
+        report.lowering = "inline";
+      else
+        report.lowering = "shared";
+
+      if(expansion.lambdaFunction)
+        report.instructionsAfter += expansion.lambdaFunction->getInstructionCount();
+      for(auto [macroFunction, specialization]: expansion.specializations)
+        report.instructionsAfter += specialization->getInstructionCount();
+
+      NumInstructionsAfter += report.instructionsAfter;
+    };
+
+    // With sampling, every thread keeps a countdown per function and only
+    // enters the macro once it reaches 0, calling the lambda directly
+    // otherwise.
+    GlobalVariable *sampleCountdowns = nullptr;
+    GlobalVariable *sampleSeed = nullptr;
+    if(optSamplePeriod == 0)
+      report_fatal_error("-macro-sample-period must be at least 1", false);
+
+    if(optHotSamplePeriod == 0)
+      report_fatal_error("-macro-hot-sample-period must be at least 1", false);
+
+    auto samplePeriodFor = [&](Function &function) -> unsigned {
+      if(optHotPolicy == HotPolicy::Sample && hotFunctions.contains(&function))
+        return optHotSamplePeriod;
+
+      return optSamplePeriod;
+    };
+
+    if(any_of(selectedFunctions, [&](Function &function) { return samplePeriodFor(function) > 1; }))
+    {
+      ArrayType *sampleCountdownsType = ArrayType::get(int32Type, selectedFunctions.size());
+      sampleCountdowns = new GlobalVariable(module, sampleCountdownsType, false, GlobalValue::InternalLinkage, ConstantAggregateZero::get(sampleCountdownsType), "macro.sample.countdown");
+      sampleCountdowns->setThreadLocal(true);
+
+      if(optSampleJitter)
+      {
+        sampleSeed = new GlobalVariable(module, int64Type, false, GlobalValue::InternalLinkage, ConstantInt::get(int64Type, 0), "macro.sample.seed");
+        sampleSeed->setThreadLocal(true);
+      }
+    }
+
+    // With a guard, every function has an enable flag and a pointer to its
+    // name in sections which are laid out in parallel by the linker, so that
+    // the runtime in macro_runtime.h can look up and flip the flags of the
+    // whole program. Both are explicitly aligned to their elements, since
+    // large globals would otherwise be padded to 16 bytes.
+    GlobalVariable *enableFlags = nullptr;
+    if(optEnable != EnableMode::Always && !selectedFunctions.empty())
+    {
+      if(!Triple(module.getTargetTriple()).isOSBinFormatELF())
+        report_fatal_error("-macro-enable is only supported for ELF targets", false);
+
+      SmallVector<uint8_t> initialFlags(selectedFunctions.size(), optEnable == EnableMode::DefaultOn);
+      Constant *enableFlagsInitializer = ConstantDataArray::get(context, initialFlags);
+      enableFlags = new GlobalVariable(module, enableFlagsInitializer->getType(), false, GlobalValue::InternalLinkage, enableFlagsInitializer, "macro.enable");
+      enableFlags->setSection("__macro_enable");
+      enableFlags->setAlignment(Align(1));
+      appendToUsed(module, enableFlags);
+
+      SmallVector<Constant *> names;
+      for(Function &function: selectedFunctions)
+        names.push_back(IRBuilder<>(context).CreateGlobalStringPtr(function.getName(), "", 0, &module));
+
+      ArrayType *namesType = ArrayType::get(opaquePointerType, names.size());
+      GlobalVariable *namesVariable = new GlobalVariable(module, namesType, true, GlobalValue::InternalLinkage, ConstantArray::get(namesType, names), "macro.names");
+      namesVariable->setSection("__macro_names");
+      namesVariable->setAlignment(dataLayout.getPointerABIAlignment(0));
+      appendToUsed(module, namesVariable);
+    }
+
+    startPhase("expand", "Expand the macro");
+
+    ///////////////////////////////////////////////////////////////
+    // Expand the macro around the selected call sites and loops //
+    ///////////////////////////////////////////////////////////////
+    //
+    // Every call site gets its own lambda, which calls the original callee
+    // with the arguments of the call site. Constant arguments are passed to
+    // the callee directly (unless the macro accesses the arguments) and the
+    // others through the lambda context. This is
+    // done before the functions are split so that the expanded call sites are
+    // moved into the lambdas along with the rest of the body. Loops are
+    // expanded with macro_def_loop() around the call to their outlined
+    // function in the same way.
+    SmallVector<CallBase *> expandedCalls(selectedCallSites.begin(), selectedCallSites.end());
+    expandedCalls.append(selectedLoops.begin(), selectedLoops.end());
+    for(size_t callSiteNumber=0; callSiteNumber<expandedCalls.size(); ++callSiteNumber)
+    {
+      CallBase *callInstr = expandedCalls[callSiteNumber];
+      Function *caller = callInstr->getFunction();
+      FunctionType *calleeType = callInstr->getFunctionType();
+      bool loop = callSiteNumber >= selectedCallSites.size();
+      std::string name = loop ? callInstr->getCalledFunction()->getName().str() : (caller->getName() + ".callsite").str();
+
+      ExpansionReport &report = (loop ? loopReports : callSiteReports).emplace_back();
+      report.name = callInstr->getCalledFunction()->getName().str();
+      report.caller = caller->getName().str();
+      report.number = selectedFunctions.size() + callSiteNumber;
+
+      SmallVector<Type *> elementTypes;
+      SmallVector<int> argIndices;
+      for(Value *arg: callInstr->args())
+        if(isa<Constant>(arg) && !argumentAccess)
+          argIndices.push_back(-1);
+        else
+        {
+          argIndices.push_back(elementTypes.size());
+          elementTypes.push_back(arg->getType());
+        }
+
+      size_t returnStorageIndex;
+      if(!calleeType->getReturnType()->isVoidTy())
+      {
+        returnStorageIndex = elementTypes.size();
+        elementTypes.push_back(calleeType->getReturnType());
+      }
+
+      StructType *lambdaContextType = StructType::get(context, elementTypes);
+      describeLambdaContext(selectedFunctions.size() + callSiteNumber, lambdaContextType, argIndices, calleeType->getReturnType()->isVoidTy() ? -1 : returnStorageIndex);
+
+      Function *lambdaFunction = Function::Create(lambdaFunctionType, GlobalValue::LinkageTypes::InternalLinkage, name + ".lambda", module);
+      copyCallSiteLambdaAttributes(*callInstr, lambdaFunction);
+      {
+        IRBuilder<> builder(BasicBlock::Create(context, "", lambdaFunction));
+
+        Argument *lambdaContext = lambdaFunction->getArg(0);
+
+        SmallVector<Value *> args;
+        for(size_t i=0; i<callInstr->arg_size(); ++i)
+          if(argIndices[i] < 0)
+            args.push_back(callInstr->getArgOperand(i));
+          else
+          {
+            Value *argValuePointer = builder.CreateGEP(lambdaContextType, lambdaContext, { builder.getInt32(0), builder.getInt32(argIndices[i]) });
+            args.push_back(builder.CreateLoad(callInstr->getArgOperand(i)->getType(), argValuePointer));
+          }
+
+        CallInst *newCallInstr = builder.CreateCall(calleeType, callInstr->getCalledOperand(), args);
+        newCallInstr->setAttributes(callInstr->getAttributes());
+        newCallInstr->setCallingConv(callInstr->getCallingConv());
+
+        if(!calleeType->getReturnType()->isVoidTy())
+        {
+          Value *returnStoragePointer = builder.CreateGEP(lambdaContextType, lambdaContext, { builder.getInt32(0), builder.getInt32(returnStorageIndex) });
+          builder.CreateStore(newCallInstr, returnStoragePointer);
+        }
+
+        builder.CreateRetVoid();
+      }
+
+      Value *lambdaContext = IRBuilder<>(&*caller->getEntryBlock().getFirstInsertionPt()).CreateAlloca(lambdaContextType);
+
+      IRBuilder<> builder(callInstr);
+      for(size_t i=0; i<callInstr->arg_size(); ++i)
+        if(argIndices[i] >= 0)
+        {
+          Value *argValuePointer = builder.CreateGEP(lambdaContextType, lambdaContext, { builder.getInt32(0), builder.getInt32(argIndices[i]) });
+          builder.CreateStore(callInstr->getArgOperand(i), argValuePointer);
+        }
+
+      // The result of an invoke is only available on the normal edge, which
+      // is split to load it from the lambda context.
+      InvokeInst *invokeInstr = dyn_cast<InvokeInst>(callInstr);
+      MacroExpansion expansion = { .macroDef = loop ? newMacroDefLoop : newMacroDefCallSite, .lambdaFunction = lambdaFunction, .lambdaIndex = lambdaIndexFor(selectedFunctions.size() + callSiteNumber), };
+      CallBase *macroDefCallInstr = createMacroCall(builder, expansion, lambdaContext, name, invokeInstr);
 
-    unsigned int sizeWidth = dataLayout.getPointerSizeInBits();
-    IntegerType *sizeType = IntegerType::getIntNTy(context, sizeWidth);
+      if(!calleeType->getReturnType()->isVoidTy())
+      {
+        if(invokeInstr)
+        {
+          BasicBlock *normalDest = invokeInstr->getNormalDest();
+          BasicBlock *returnBlock = BasicBlock::Create(context, "", caller, normalDest);
+          normalDest->replacePhiUsesWith(invokeInstr->getParent(), returnBlock);
+          cast<InvokeInst>(macroDefCallInstr)->setNormalDest(returnBlock);
 
-    SMDiagnostic err;
+          builder.SetInsertPoint(returnBlock);
+        }
 
-    std::unique_ptr<Module> macroModule = parseIRFile(MacroFilename::get(), err, context);
-    if(!macroModule)
-      report_fatal_error("failed to load macro module:" + Twine(MacroFilename::get()) + " (note: textual IR is not supported when invoked via clang, this may or may not be the issue)", false);
+        Value *returnStoragePointer = builder.CreateGEP(lambdaContextType, lambdaContext, { builder.getInt32(0), builder.getInt32(returnStorageIndex) });
+        Value *returnStorage = builder.CreateLoad(calleeType->getReturnType(), returnStoragePointer);
+        callInstr->replaceAllUsesWith(returnStorage);
 
-    auto moduleSplitIt = --module.end();
-    if(Linker::linkModules(module, std::move(macroModule)))
-      report_fatal_error("failed to link macro module:" + Twine(MacroFilename::get()), false);
-    ++moduleSplitIt;
+        if(invokeInstr)
+          builder.CreateBr(invokeInstr->getNormalDest());
+      }
+      callInstr->eraseFromParent();
+      dropInferredAttributes(*caller);
 
-    SmallVector<std::reference_wrapper<Function>> mainFunctions(module.begin(), moduleSplitIt);
-    SmallVector<std::reference_wrapper<Function>> macroFunctions(moduleSplitIt, module.end());
+      if(expansion.inlineMacro)
+        inlineMacroCall(expansion, macroDefCallInstr);
 
-    Function *macroDef = nullptr;
-    Function *macroCall = nullptr;
-    Function *macroCount = nullptr;
-    Function *macroIndex = nullptr;
-    Function *macroArray = nullptr;
+      reportExpansion(report, expansion);
+    }
 
-    for(Function &function: macroFunctions)
+    size_t lambdaCount = 0;
+    for(Function &function: selectedFunctions)
     {
-      StringRef name = function.getName();
-      if(!macroDef && name == "macro_def")
-      {
-        macroDef = &function;
-        if(!functionIsDefined(*macroDef) || !functionCheckSignature(*macroDef, voidType, {}))
-          report_fatal_error("invalid definition of macro_def: macro_def must be a defined function with the following signature (without name mangling): void macro_def(void)", false);
-      }
-      else if(!macroCall && name == "macro_call")
-      {
-        macroCall = &function;
-        if(functionIsDefined(*macroCall) || !functionCheckSignature(*macroCall, voidType, {}))
-          report_fatal_error("invalid definition of macro_call: macro_call must be a external function with the following signature (without name mangling): void macro_call(void)", false);
-      }
-      else if(!macroCount && name == "macro_count")
-      {
-        macroCount = &function;
-        if(functionIsDefined(*macroCount) || !functionCheckSignature(*macroCount, sizeType, {}))
-          report_fatal_error("invalid definition of macro_count: macro_count must be a external function with the following signature (without name mangling): size_t macro_count(void)", false);
-      }
-      else if(!macroIndex && name == "macro_index")
+      ///////////////////////////////////////////////////////////////////////////
+      // Create the type for lambda context out of original function signature //
+      ///////////////////////////////////////////////////////////////////////////
+      FunctionType *functionType = function.getFunctionType();
+
+      SmallVector<Type *> elementTypes;
+      elementTypes.assign(functionType->param_begin(), functionType->param_end());
+
+      size_t vaListIndex;
+      if(functionType->isVarArg())
       {
-        macroIndex = &function;
-        if(functionIsDefined(*macroIndex) || !functionCheckSignature(*macroIndex, sizeType, {}))
-          report_fatal_error("invalid definition of macro_index: macro_index must be a external function with the following signature (without name mangling): size_t macro_index(void)", false);
+        vaListIndex = elementTypes.size();
+        elementTypes.push_back(vaListType);
       }
-      else if(!macroArray && name == "macro_array")
+
+      size_t returnStorageIndex;
+      if(!functionType->getReturnType()->isVoidTy())
       {
-        macroArray = &function;
-        if(functionIsDefined(*macroArray) || !functionCheckSignature(*macroArray, opaquePointerType, {sizeType, sizeType, sizeType}))
-          report_fatal_error("invalid definition of macro_array: macro_array must be a external function with the following signature (without name mangling): void *macro_array(size_t id, size_t size, size_t alignment)", false);
+        returnStorageIndex = elementTypes.size();
+        elementTypes.push_back(functionType->getReturnType());
       }
-    }
 
-    if(!macroDef)
-      report_fatal_error("missing definition of void macro_def(void) (without name mangling)", false);
+      StructType *lambdaContextType = StructType::get(context, elementTypes);
 
-    Function *newMacroDef = nullptr;
+      SmallVector<int> argIndices;
+      for(size_t i=0; i<functionType->getNumParams(); ++i)
+        argIndices.push_back(i);
 
-    SmallDenseMap<Function *, Function *> macroFunctionsMap;
-    for(Function &function: macroFunctions)
-      if(functionIsDefined(function))
-      {
-        FunctionType *functionType = function.getFunctionType();
+      describeLambdaContext(lambdaCount, lambdaContextType, argIndices, functionType->getReturnType()->isVoidTy() ? -1 : returnStorageIndex);
 
-        SmallVector<Type *> newParams;
-        newParams.push_back(opaquePointerType);
-        newParams.push_back(opaquePointerType);
-        newParams.push_back(sizeType);
-        newParams.insert(newParams.end(), functionType->param_begin(), functionType->param_end());
+      ///////////////////////////////////////////////////////////
+      // Create the lambda function from the original function //
+      ///////////////////////////////////////////////////////////
+      Function *lambdaFunction = Function::Create(lambdaFunctionType, GlobalValue::LinkageTypes::InternalLinkage, function.getName() + ".lambda", module);
 
-        FunctionType *newFunctionType = FunctionType::get(functionType->getReturnType(), newParams, functionType->isVarArg());
-        Function *newFunction = Function::Create(newFunctionType, GlobalValue::LinkageTypes::InternalLinkage, function.getName() + ".clone", module);
+      copyLambdaAttributes(function, lambdaFunction);
 
-        ValueToValueMapTy VMap;
-        for(size_t i=0; i<function.arg_size(); ++i)
-          VMap.insert({ function.getArg(i), newFunction->getArg(i+3) });
+      if(function.hasPersonalityFn())
+        lambdaFunction->setPersonalityFn(function.getPersonalityFn());
 
-        SmallVector<ReturnInst *> Returns;
-        CloneFunctionInto(newFunction, &function, VMap, CloneFunctionChangeType::LocalChangesOnly, Returns);
+      if(std::optional<Function::ProfileCount> entryCount = function.getEntryCount())
+        lambdaFunction->setEntryCount(*entryCount);
+      BasicBlock *lambdaEntryBlock = BasicBlock::Create(context, "", lambdaFunction);
+      {
+        IRBuilder<> builder(lambdaEntryBlock);
 
-        macroFunctionsMap.insert({&function, newFunction});
-        if(&function == macroDef)
-          newMacroDef = newFunction;
-      }
+        Argument *lambdaContext = lambdaFunction->getArg(0);
 
-    // We have already found a definition for macro_def() above (or else we
-    // would have erred out) so this should never happen.
-    assert(newMacroDef);
+        for(size_t i=0; i<functionType->getNumParams(); ++i)
+        {
+          Value *argValuePointer = builder.CreateGEP(lambdaContextType, lambdaContext, { builder.getInt32(0), builder.getInt32(i) });
+          LoadInst *argValue = builder.CreateLoad(functionType->getParamType(i), argValuePointer);
+          annotateArgumentLoad(*function.getArg(i), argValue);
+          function.getArg(i)->replaceAllUsesWith(argValue);
+        }
 
-    struct ArraySpec
-    {
-      uint64_t size;
-      uint64_t alignment;
-    };
+        Value *vaListPointer;
+        if(functionType->isVarArg())
+          vaListPointer = builder.CreateGEP(lambdaContextType, lambdaContext, { builder.getInt32(0), builder.getInt32(vaListIndex) });
 
-    SmallDenseMap<uint64_t, ArraySpec> arraySpecs;
+        Value *returnStoragePointer;
+        if(!functionType->getReturnType()->isVoidTy())
+          returnStoragePointer = builder.CreateGEP(lambdaContextType, lambdaContext, { builder.getInt32(0), builder.getInt32(returnStorageIndex) });
 
-    FunctionType *lambdaFunctionType = FunctionType::get(voidType, opaquePointerType, false);
+        for(BasicBlock& block : function)
+        {
+          if(functionType->isVarArg())
+            for(Instruction &instr : make_early_inc_range(make_range(block.begin(), --block.end())))
+              if(VAStartInst *vaStartInstr = dyn_cast<VAStartInst>(&instr))
+              {
+                IRBuilder<> builder(vaStartInstr);
+                builder.CreateBinaryIntrinsic(Intrinsic::vacopy, vaStartInstr->getArgList(), vaListPointer);
+                vaStartInstr->eraseFromParent();
+              }
 
-    for(auto [function, newFunction]: macroFunctionsMap)
-    {
-      for(BasicBlock &block : *function)
-        for(Instruction &instr : make_early_inc_range(make_range(block.begin(), --block.end())))
-          if(CallInst *callInstr = dyn_cast<CallInst>(&instr))
-          {
-            Function *calledFunction = callInstr->getCalledFunction();
-            if(calledFunction == macroCall)
+          if(!functionType->getReturnType()->isVoidTy())
+            if(ReturnInst *returnInstr = dyn_cast<ReturnInst>(&block.back()))
             {
-              IRBuilder<> builder(callInstr);
-
-              CallInst *newCallInstr = builder.CreateIntrinsic(Intrinsic::trap, {}, {});
-              callInstr->replaceAllUsesWith(newCallInstr);
-              callInstr->eraseFromParent();
+              IRBuilder<> builder(returnInstr);
+              builder.CreateStore(returnInstr->getReturnValue(), returnStoragePointer);
+              builder.CreateRetVoid();
+              returnInstr->eraseFromParent();
             }
-            else if(calledFunction == macroIndex)
-            {
-              IRBuilder<> builder(callInstr);
+        }
 
-              CallInst *newCallInstr = builder.CreateIntrinsic(Intrinsic::trap, {}, {});
-              callInstr->replaceAllUsesWith(builder.getIntN(sizeWidth, 0));
-              callInstr->eraseFromParent();
-            }
-          }
+        builder.CreateBr(&*function.begin());
+      }
+      lambdaFunction->splice(lambdaFunction->end(), &function, function.begin(), function.end());
 
-      for(BasicBlock &block : *newFunction)
+      if(optNoInline)
       {
-        Value *lambdaFunction = newFunction->getArg(0);
-        Value *lambdaContext = newFunction->getArg(1);
-        Value *lambdaIndex = newFunction->getArg(2);
+        function.removeFnAttr(Attribute::InlineHint);
+        function.addFnAttr(Attribute::NoInline);
+      }
 
-        for(Instruction &instr : make_early_inc_range(make_range(block.begin(), --block.end())))
-          if(CallInst *callInstr = dyn_cast<CallInst>(&instr))
-          {
-            Function *calledFunction = callInstr->getCalledFunction();
-            if(calledFunction == macroCall)
-            {
-              IRBuilder<> builder(callInstr);
+      /////////////////////////////////////////////////////
+      // Replace the original function with a trampoline //
+      /////////////////////////////////////////////////////
+      dropInferredAttributes(function);
+      BasicBlock *trampolineBlock = BasicBlock::Create(context, "", &function);
+      {
+        IRBuilder<> builder(trampolineBlock);
 
-              CallInst *newCallInstr = builder.CreateCall(lambdaFunctionType, lambdaFunction, lambdaContext);
-              callInstr->replaceAllUsesWith(newCallInstr);
-              callInstr->eraseFromParent();
-            }
-            else if(calledFunction == macroIndex)
-            {
-              callInstr->replaceAllUsesWith(lambdaIndex);
-              callInstr->eraseFromParent();
-            }
-            else if(calledFunction == macroArray)
-            {
-              // Note: We kinda relied on the frontend to do all necessary
-              //       constant folding.
-              //
-              // Note: While we are checking for overflow, size_t is always
-              //       smaller than uint64_t until the day we start using
-              //       128-bit computer, so the overflow should never happen.
-
-              uint64_t id;
-              switch(valueAsUint64(id, callInstr->getOperand(0)))
-              {
-              case ERROR_NOT_CONSTANT:
-                report_fatal_error("id argument passed to void *macro_array(size_t id, size_t size, size_t alignment) must be a constant");
-              case ERROR_OVERFLOW:
-                report_fatal_error("overflow on id argument passed to void *macro_array(size_t id, size_t size, size_t alignment)");
-              }
+        Value *lambdaContext = builder.CreateAlloca(lambdaContextType);
 
-              uint64_t size;
-              switch(valueAsUint64(size, callInstr->getOperand(1)))
-              {
-              case ERROR_NOT_CONSTANT:
-                report_fatal_error("size argument passed to void *macro_array(size_t id, size_t size, size_t alignment) must be a constant");
-              case ERROR_OVERFLOW:
-                report_fatal_error("overflow on size argument passed to void *macro_array(size_t id, size_t size, size_t alignment)");
-              }
+        for(size_t i=0; i<function.arg_size(); ++i)
+        {
+          Value *argValuePointer = builder.CreateGEP(lambdaContextType, lambdaContext, { builder.getInt32(0), builder.getInt32(i) });
+          builder.CreateStore(function.getArg(i), argValuePointer);
+        }
 
-              uint64_t alignment;
-              switch(valueAsUint64(alignment, callInstr->getOperand(2)))
-              {
-              case ERROR_NOT_CONSTANT:
-                report_fatal_error("alignment argument passed to void *macro_array(size_t id, size_t size, size_t alignment) must be a constant");
-              case ERROR_OVERFLOW:
-                report_fatal_error("overflow on alignment argument passed to void *macro_array(size_t id, size_t size, size_t alignment)");
-              }
+        Value *vaListPointer;
+        if(functionType->isVarArg())
+          vaListPointer = builder.CreateGEP(lambdaContextType, lambdaContext, { builder.getInt32(0), builder.getInt32(vaListIndex) });
 
-              if(alignment == 0)
-                report_fatal_error("alignment argument passed to void *macro_array(size_t id, size_t size, size_t alignment) must be a non-zero");
+        if(functionType->isVarArg())
+          builder.CreateUnaryIntrinsic(Intrinsic::vastart, vaListPointer);
 
-              if(!isPowerOf2_64(alignment))
-                report_fatal_error("alignment argument passed to void *macro_array(size_t id, size_t size, size_t alignment) must be power of 2");
+        size_t lambdaNumber = lambdaCount++;
+        Constant *lambdaIndex = lambdaIndexFor(lambdaNumber);
 
-              if(size % alignment != 0)
-                report_fatal_error("alignment argument passed to void *macro_array(size_t id, size_t size, size_t alignment) must divide size");
+        // Calls which are disabled or not sampled skip the macro and call the
+        // lambda directly.
+        unsigned samplePeriod = samplePeriodFor(function);
+        BasicBlock *skipBlock = nullptr;
+        BasicBlock *returnBlock = nullptr;
+        if(enableFlags || samplePeriod > 1)
+        {
+          skipBlock = BasicBlock::Create(context, "", &function);
+          returnBlock = BasicBlock::Create(context, "", &function);
 
-              auto [it, success] = arraySpecs.insert({id, { .size = size, .alignment = alignment, }});
-              if(!success && (it->second.size != size || it->second.alignment != alignment))
-                report_fatal_error("multiple call to void *macro_array(size_t id, size_t size, size_t alignment) with same id but different size or alignment");
-            }
-            else if(auto it = macroFunctionsMap.find(calledFunction); it != macroFunctionsMap.end())
-            {
-              IRBuilder<> builder(callInstr);
+          IRBuilder<> skipBuilder(skipBlock);
+          skipBuilder.CreateCall(lambdaFunctionType, lambdaFunction, {lambdaContext});
+          skipBuilder.CreateBr(returnBlock);
+        }
 
-              SmallVector<Value *> newArgs;
-              newArgs.push_back(lambdaFunction);
-              newArgs.push_back(lambdaContext);
-              newArgs.push_back(lambdaIndex);
-              newArgs.insert(newArgs.end(), callInstr->arg_begin(), callInstr->arg_end());
+        if(enableFlags)
+        {
+          BasicBlock *enabledBlock = BasicBlock::Create(context, "", &function, skipBlock);
+
+          // The flags are flipped concurrently by the runtime, and the branch
+          // has the same weights as __builtin_expect(enabled, 1) with
+          // default-on and __builtin_expect(enabled, 0) with default-off.
+          Value *enableFlagPointer = builder.CreateConstInBoundsGEP2_64(enableFlags->getValueType(), enableFlags, 0, lambdaNumber);
+          LoadInst *enableFlag = builder.CreateLoad(int8Type, enableFlagPointer);
+          enableFlag->setAtomic(AtomicOrdering::Monotonic);
+          enableFlag->setAlignment(Align(1));
+          MDNode *enableWeights = optEnable == EnableMode::DefaultOn ? MDBuilder(context).createBranchWeights(2000, 1) : MDBuilder(context).createBranchWeights(1, 2000);
+          builder.CreateCondBr(builder.CreateICmpNE(enableFlag, builder.getInt8(0)), enabledBlock, skipBlock, enableWeights);
+
+          builder.SetInsertPoint(enabledBlock);
+        }
 
-              CallInst *newCallInstr = builder.CreateCall(it->second->getFunctionType(), it->second, newArgs);
-              callInstr->replaceAllUsesWith(newCallInstr);
-              callInstr->eraseFromParent();
-            }
+        if(samplePeriod > 1)
+        {
+          BasicBlock *sampleBlock = BasicBlock::Create(context, "", &function, skipBlock);
+          BasicBlock *countBlock = BasicBlock::Create(context, "", &function, skipBlock);
+
+          Value *countdowns = builder.CreateThreadLocalAddress(sampleCountdowns);
+          Value *countdownPointer = builder.CreateConstInBoundsGEP2_64(sampleCountdowns->getValueType(), countdowns, 0, lambdaNumber);
+          Value *countdown = builder.CreateLoad(int32Type, countdownPointer);
+          builder.CreateCondBr(builder.CreateICmpEQ(countdown, builder.getInt32(0)), sampleBlock, countBlock, MDBuilder(context).createBranchWeights(1, samplePeriod - 1));
+
+          builder.SetInsertPoint(countBlock);
+          builder.CreateStore(builder.CreateSub(countdown, builder.getInt32(1)), countdownPointer);
+          builder.CreateBr(skipBlock);
+
+          // The countdown is reset to period - 1, or to a random value in
+          // [period / 2, period + period / 2) with jitter, using a per-thread
+          // xorshift generator seeded with the address of its state.
+          builder.SetInsertPoint(sampleBlock);
+          Value *reset = builder.getInt32(samplePeriod - 1);
+          if(sampleSeed)
+          {
+            Value *seedPointer = builder.CreateThreadLocalAddress(sampleSeed);
+            Value *seed = builder.CreateLoad(int64Type, seedPointer);
+            Value *initialSeed = builder.CreateOr(builder.CreatePtrToInt(seedPointer, int64Type), 1);
+            seed = builder.CreateSelect(builder.CreateICmpEQ(seed, builder.getInt64(0)), initialSeed, seed);
+            seed = builder.CreateXor(seed, builder.CreateShl(seed, 13));
+            seed = builder.CreateXor(seed, builder.CreateLShr(seed, 7));
+            seed = builder.CreateXor(seed, builder.CreateShl(seed, 17));
+            builder.CreateStore(seed, seedPointer);
+
+            Value *jitter = builder.CreateTrunc(builder.CreateURem(seed, builder.getInt64(samplePeriod)), int32Type);
+            reset = builder.CreateAdd(jitter, builder.getInt32(samplePeriod / 2));
           }
-      }
-    }
-
-    // According to LLVM documentation
-    // https://llvm.org/docs/LangRef.html#variable-argument-handling-intrinsics,
-    // the type for va_list is { ptr } except in the case of Unix x86_64
-    // platforms in which case the type for va_list is { i32, i32, ptr, ptr }.
-    //
-    // FIXME: We check for whether we are on Unix by checking if we are not on
-    //        Windows. This is technically not correct but should work in most
-    //        of the cases.
-    Type *vaListType;
-    if(llvm::Triple triple(module.getTargetTriple()); triple.getArch() == Triple::ArchType::x86_64 && !triple.isOSWindows())
-      vaListType = StructType::get(context, { int32Type, int32Type, opaquePointerType, opaquePointerType, });
-    else
-      vaListType = StructType::get(context, opaquePointerType);
+          builder.CreateStore(reset, countdownPointer);
+        }
 
-    size_t lambdaCount = 0;
-    for(Function &function: mainFunctions)
-      if(functionIsDefined(function))
-      {
-        ///////////////////////////////////////////////////////////////////////////
-        // Create the type for lambda context out of original function signature //
-        ///////////////////////////////////////////////////////////////////////////
-        FunctionType *functionType = function.getFunctionType();
+        Function *functionMacroDef = newMacroDef;
+        if(optHotPolicy == HotPolicy::Lightweight && hotFunctions.contains(&function))
+          functionMacroDef = newMacroDefHot;
 
-        SmallVector<Type *> elementTypes;
-        elementTypes.assign(functionType->param_begin(), functionType->param_end());
+        MacroExpansion expansion = { .macroDef = functionMacroDef, .lambdaFunction = lambdaFunction, .lambdaIndex = lambdaIndex, };
+        CallBase *macroDefCallInstr = createMacroCall(builder, expansion, lambdaContext, function.getName(), nullptr);
 
-        size_t vaListIndex;
-        if(functionType->isVarArg())
+        if(returnBlock)
         {
-          vaListIndex = elementTypes.size();
-          elementTypes.push_back(vaListType);
+          builder.CreateBr(returnBlock);
+          builder.SetInsertPoint(returnBlock);
         }
 
-        size_t returnStorageIndex;
+        if(functionType->isVarArg())
+          builder.CreateUnaryIntrinsic(Intrinsic::vaend, vaListPointer);
+
         if(!functionType->getReturnType()->isVoidTy())
         {
-          returnStorageIndex = elementTypes.size();
-          elementTypes.push_back(functionType->getReturnType());
+          Value *returnStoragePointer = builder.CreateGEP(lambdaContextType, lambdaContext, { builder.getInt32(0), builder.getInt32(returnStorageIndex) });
+          Value *returnStorage = builder.CreateLoad(functionType->getReturnType(), returnStoragePointer);
+          builder.CreateRet(returnStorage);
         }
+        else
+          builder.CreateRetVoid();
 
-        StructType *lambdaContextType = StructType::get(context, elementTypes);
+        if(expansion.inlineMacro)
+          inlineMacroCall(expansion, macroDefCallInstr);
 
-        ///////////////////////////////////////////////////////////
-        // Create the lambda function from the original function //
-        ///////////////////////////////////////////////////////////
-        Function *lambdaFunction = Function::Create(lambdaFunctionType, GlobalValue::LinkageTypes::InternalLinkage, function.getName() + ".lambda", module);
-        BasicBlock *lambdaEntryBlock = BasicBlock::Create(context, "", lambdaFunction);
-        {
-          IRBuilder<> builder(lambdaEntryBlock);
+        ExpansionReport &report = functionReports[functionReportIndices.lookup(&function)];
+        report.number = lambdaNumber;
+        report.instructionsAfter = function.getInstructionCount();
+        reportExpansion(report, expansion);
+      }
+    }
 
-          Argument *lambdaContext = lambdaFunction->getArg(0);
+    startPhase("finalize", "Emit descriptors and lower the remaining builtins");
 
-          for(size_t i=0; i<functionType->getNumParams(); ++i)
-          {
-            Value *argValuePointer = builder.CreateGEP(lambdaContextType, lambdaContext, { builder.getInt32(0), builder.getInt32(i) });
-            Value *argValue = builder.CreateLoad(functionType->getParamType(i), argValuePointer);
-            function.getArg(i)->replaceAllUsesWith(argValue);
-          }
+    if(descriptorsVariable)
+    {
+      SmallVector<Constant *> descriptors;
+      for(size_t i=0; i<descriptorFields.size(); ++i)
+      {
+        SmallVector<Constant *, 8> &fields = descriptorFields[i];
+        if(enableFlags && i < selectedFunctions.size())
+          fields.push_back(ConstantExpr::getInBoundsGetElementPtr(enableFlags->getValueType(), enableFlags, ArrayRef<Constant *>{ ConstantInt::get(int64Type, 0), ConstantInt::get(int64Type, i) }));
+        else
+          fields.push_back(ConstantPointerNull::get(opaquePointerType));
+        descriptors.push_back(ConstantStruct::get(descriptorType, fields));
+      }
 
-          Value *vaListPointer;
-          if(functionType->isVarArg())
-            vaListPointer = builder.CreateGEP(lambdaContextType, lambdaContext, { builder.getInt32(0), builder.getInt32(vaListIndex) });
+      descriptorsVariable->setInitializer(ConstantArray::get(cast<ArrayType>(descriptorsVariable->getValueType()), descriptors));
+    }
 
-          Value *returnStoragePointer;
-          if(!functionType->getReturnType()->isVoidTy())
-            returnStoragePointer = builder.CreateGEP(lambdaContextType, lambdaContext, { builder.getInt32(0), builder.getInt32(returnStorageIndex) });
+    // The shared macro clones are left unused if every wrapped function got its
+    // own specialization.
+    for(bool changed = true; changed;)
+    {
+      changed = false;
+      for(Function *function: SmallVector<Function *>(macroClones.begin(), macroClones.end()))
+        if(function->use_empty())
+        {
+          macroClones.erase(function);
+          function->eraseFromParent();
+          changed = true;
+        }
+    }
 
-          for(BasicBlock& block : function)
-          {
-            if(functionType->isVarArg())
-              for(Instruction &instr : make_early_inc_range(make_range(block.begin(), --block.end())))
-                if(VAStartInst *vaStartInstr = dyn_cast<VAStartInst>(&instr))
-                {
-                  IRBuilder<> builder(vaStartInstr);
-                  builder.CreateBinaryIntrinsic(Intrinsic::vacopy, vaStartInstr->getArgList(), vaListPointer);
-                  vaStartInstr->eraseFromParent();
-                }
-
-            if(!functionType->getReturnType()->isVoidTy())
-              if(ReturnInst *returnInstr = dyn_cast<ReturnInst>(&block.back()))
-              {
-                IRBuilder<> builder(returnInstr);
-                builder.CreateStore(returnInstr->getReturnValue(), returnStoragePointer);
-                builder.CreateRetVoid();
-                returnInstr->eraseFromParent();
-              }
-          }
+    // The remaining clones may call any lambda, so they are not nounwind even
+    // if the macro is.
+    for(Function *function: macroClones)
+      function->removeFnAttr(Attribute::NoUnwind);
 
-          builder.CreateBr(&*function.begin());
-        }
-        lambdaFunction->splice(lambdaFunction->end(), &function, function.begin(), function.end());
+    if(indexSlots)
+    {
+      ArrayType *indexSlotsType = ArrayType::get(int8Type, lambdaTotal);
+      GlobalVariable *newIndexSlots = new GlobalVariable(module, indexSlotsType, false, GlobalValue::InternalLinkage, ConstantAggregateZero::get(indexSlotsType), "macro.index");
+      newIndexSlots->setSection("__macro_index");
 
-        /////////////////////////////////////////////////////
-        // Replace the original function with a trampoline //
-        /////////////////////////////////////////////////////
-        BasicBlock *trampolineBlock = BasicBlock::Create(context, "", &function);
-        {
-          IRBuilder<> builder(trampolineBlock);
+      // Large globals are otherwise aligned to 16 bytes, which would leave
+      // padding between the contributions of each module to the section.
+      newIndexSlots->setAlignment(Align(1));
+      appendToUsed(module, newIndexSlots);
 
-          Value *lambdaContext = builder.CreateAlloca(lambdaContextType);
+      indexSlots->replaceAllUsesWith(newIndexSlots);
+      indexSlots->eraseFromParent();
+    }
 
-          for(size_t i=0; i<function.arg_size(); ++i)
-          {
-            Value *argValuePointer = builder.CreateGEP(lambdaContextType, lambdaContext, { builder.getInt32(0), builder.getInt32(i) });
-            builder.CreateStore(function.getArg(i), argValuePointer);
-          }
+    auto makeShared = [&](Function *function) {
+      if(!function->getName().starts_with(macroPrefix))
+        function->setName(macroPrefix + function->getName());
 
-          Value *vaListPointer;
-          if(functionType->isVarArg())
-            vaListPointer = builder.CreateGEP(lambdaContextType, lambdaContext, { builder.getInt32(0), builder.getInt32(vaListIndex) });
+      function->setLinkage(GlobalValue::LinkOnceODRLinkage);
+      function->setVisibility(GlobalValue::HiddenVisibility);
+      if(comdat)
+        function->setComdat(module.getOrInsertComdat(function->getName()));
+    };
 
-          if(functionType->isVarArg())
-            builder.CreateUnaryIntrinsic(Intrinsic::vastart, vaListPointer);
+    // Macro functions which do not depend on per-module state, i.e. do not
+    // (transitively) call macro_count(), access macro local storage or the
+    // descriptors unless they are defined over the whole program, are the same
+    // in every module and can be deduplicated by the linker.
+    if(optComdat)
+    {
+      SmallPtrSet<Value *, 16> perModuleValues;
+      if(!programScope)
+      {
+        if(macroCount)
+          perModuleValues.insert(macroCount);
 
-          Value *lambdaIndex = builder.getIntN(sizeWidth, lambdaCount++);
+        if(descriptorsVariable)
+          perModuleValues.insert(descriptorsVariable);
 
-          builder.CreateCall(newMacroDef->getFunctionType(), newMacroDef, {lambdaFunction, lambdaContext, lambdaIndex});
+        for(Storage &storage: storages)
+        {
+          for(auto [id, arrayBase]: storage.arrayBases)
+            perModuleValues.insert(arrayBase);
 
-          if(functionType->isVarArg())
-            builder.CreateUnaryIntrinsic(Intrinsic::vaend, vaListPointer);
+          if(storage.recordBase)
+            perModuleValues.insert(storage.recordBase);
 
-          if(!functionType->getReturnType()->isVoidTy())
-          {
-            Value *returnStoragePointer = builder.CreateGEP(lambdaContextType, lambdaContext, { builder.getInt32(0), builder.getInt32(returnStorageIndex) });
-            Value *returnStorage = builder.CreateLoad(functionType->getReturnType(), returnStoragePointer);
-            builder.CreateRet(returnStorage);
-          }
-          else
-            builder.CreateRetVoid();
+          for(auto [id, slabTable]: storage.slabTables)
+            perModuleValues.insert(slabTable);
         }
       }
 
+      SmallPtrSet<Function *, 16> perModuleClones;
+      for(bool changed = true; changed;)
+      {
+        changed = false;
+        for(Function *function: macroClones)
+          if(!perModuleClones.contains(function))
+            for(BasicBlock &block : *function)
+              for(Instruction &instr : block)
+                for(Value *operand: instr.operands())
+                  if(valueReferencesAny(operand, perModuleValues) && perModuleClones.insert(function).second)
+                  {
+                    perModuleValues.insert(function);
+                    changed = true;
+                  }
+      }
+
+      for(auto [function, newFunction]: macroFunctionsMap)
+        if(macroClones.contains(newFunction) && !perModuleClones.contains(newFunction))
+        {
+          newFunction->setName(function->getName() + ".clone");
+          makeShared(newFunction);
+        }
+    }
+
     if(macroCount)
     {
       Function *newMacroCount = Function::Create(macroCount->getFunctionType(), llvm::GlobalValue::InternalLinkage, "macro_count.def", &module);
 
       BasicBlock *block = BasicBlock::Create(context, "", newMacroCount);
       IRBuilder<> builder(block);
-      builder.CreateRet(builder.getIntN(sizeWidth, lambdaCount));
+      if(programScope)
+      {
+        Value *indexStart = builder.CreatePtrToInt(sectionBoundary(module, "__macro_index", false), sizeType);
+        Value *indexStop = builder.CreatePtrToInt(sectionBoundary(module, "__macro_index", true), sizeType);
+        builder.CreateRet(builder.CreateSub(indexStop, indexStart));
+      }
+      else
+        builder.CreateRet(builder.getIntN(sizeWidth, lambdaTotal));
+
+      if(programScope && optComdat)
+        makeShared(newMacroCount);
 
       macroCount->replaceAllUsesWith(newMacroCount);
       macroCount->eraseFromParent();
     }
 
-    if(macroArray)
+    // Calls to macro_array() remain only in the original macro functions.
+    if(macroArray && !macroArray->use_empty())
     {
       Function *newMacroArray = Function::Create(macroArray->getFunctionType(), llvm::GlobalValue::InternalLinkage, "macro_array.def", &module);
 
@@ -475,32 +3132,61 @@ public:
 
       {
         IRBuilder<> builder(switchBlock);
-        SwitchInst *switchInstr = builder.CreateSwitch(newMacroArray->getArg(0), failedBlock, arraySpecs.size());
-        for(auto&& [id, arraySpec]: arraySpecs)
+        Storage &storage = storageFor(StorageClass::Static);
+        SwitchInst *switchInstr = builder.CreateSwitch(newMacroArray->getArg(0), failedBlock, storage.arrayBases.size());
+        for(auto [id, arrayBase]: storage.arrayBases)
         {
           BasicBlock *successBlock = BasicBlock::Create(context, "", newMacroArray);
           {
             IRBuilder<> builder(successBlock);
-
-            // FIXME: Check for overflow.
-            ArrayType *arrayType = ArrayType::get(Type::getInt8Ty(context), arraySpec.size * lambdaCount);
-            GlobalVariable *globalVariable = new GlobalVariable(module, arrayType, false, llvm::GlobalValue::InternalLinkage, ConstantAggregateZero::get(arrayType));
-            globalVariable->setAlignment(Align(arraySpec.alignment));
-
-            builder.CreateRet(globalVariable);
+            builder.CreateRet(arrayBase);
           }
           switchInstr->addCase(builder.getIntN(sizeWidth, id), successBlock);
         }
       }
 
+      if(programScope && optComdat)
+        makeShared(newMacroArray);
+
       macroArray->replaceAllUsesWith(newMacroArray);
-      macroArray->eraseFromParent();
     }
 
+    if(macroArray)
+      macroArray->eraseFromParent();
+
+    for(Function *builtin: {macroLocalPtr, macroTlsArray, macroLocalTlsPtr, macroLocalPercpuPtr, macroLocalPercpuShardPtr, macroPercpuCount, macroFunctionName, macroSourceFile, macroSourceLine, macroFunctionId, macroArgCount, macroArgPtr, macroArgSize, macroReturnPtr, macroUnlikely, macroLoopTripCount})
+      if(builtin)
+        builtin->eraseFromParent();
+
+    phaseTimer.reset();
+
+    if(!optReport.empty())
+      writeReport(module, macroFilenames, functionReports, callSiteReports, loopReports, storageReports, storageBytes, macroFunctionsMap.size());
+
+    for(Function &function: module)
+      if(!function.isDeclaration())
+        function.addFnAttr("macro-applied");
+
     return PreservedAnalyses::none();
   }
 };
 
+// Nothing optimizes the code generated for the macro after the late extension
+// points, which would leave e.g. the lambda contexts on the stack, so the
+// functions are cleaned up once more. Specializations of the macro which are
+// not inlined by the pass itself remain calls.
+static void addLateCleanupPasses(ModulePassManager &PM, OptimizationLevel level)
+{
+  if(level == OptimizationLevel::O0)
+    return;
+
+  FunctionPassManager FPM;
+  FPM.addPass(SROAPass(SROAOptions::ModifyCFG));
+  FPM.addPass(InstCombinePass());
+  FPM.addPass(SimplifyCFGPass());
+  PM.addPass(createModuleToFunctionPassAdaptor(std::move(FPM)));
+}
+
 extern "C" PassPluginLibraryInfo llvmGetPassPluginInfo()
 {
   return {
@@ -516,7 +3202,29 @@ extern "C" PassPluginLibraryInfo llvmGetPassPluginInfo()
           return true;
       });
       PB.registerPipelineStartEPCallback([](ModulePassManager &PM, OptimizationLevel) {
-          PM.addPass(MacroModulePass());
+          if(optExtensionPoint == ExtensionPoint::Start)
+            PM.addPass(MacroModulePass());
+      });
+      PB.registerOptimizerEarlyEPCallback([](ModulePassManager &PM, OptimizationLevel) {
+          if(optExtensionPoint == ExtensionPoint::OptimizerEarly)
+            PM.addPass(MacroModulePass());
+      });
+      // The ThinLTO pre-link pipeline runs the optimizer-last extension point
+      // after inlining and right before the summary is built. The functions
+      // marked by the pass keep the ThinLTO backend from applying it again.
+      PB.registerOptimizerLastEPCallback([](ModulePassManager &PM, OptimizationLevel level) {
+          if(optExtensionPoint == ExtensionPoint::OptimizerLast || optExtensionPoint == ExtensionPoint::ThinLTOPreLink)
+          {
+            PM.addPass(MacroModulePass());
+            addLateCleanupPasses(PM, level);
+          }
+      });
+      PB.registerFullLinkTimeOptimizationLastEPCallback([](ModulePassManager &PM, OptimizationLevel level) {
+          if(optExtensionPoint == ExtensionPoint::FullLTOLast)
+          {
+            PM.addPass(MacroModulePass());
+            addLateCleanupPasses(PM, level);
+          }
       });
     },
   };
@@ -2,6 +2,7 @@
 #define MACRO_H
 
 #include <stddef.h>
+#include <stdint.h>
 #include <stdalign.h>
 
 #ifdef __cplusplus
@@ -9,13 +10,47 @@ extern "C" {
 #endif
 
 void macro_def(void);
+void macro_def_hot(void);
+void macro_def_callsite(void);
+void macro_def_loop(void);
 void macro_call(void);
 
 size_t macro_count(void);
 size_t macro_index(void);
 void *macro_array(size_t id, size_t size, size_t alignment);
+void *macro_local_ptr(size_t id, size_t size, size_t alignment);
+void *macro_tls_array(size_t id, size_t size, size_t alignment);
+void *macro_local_tls_ptr(size_t id, size_t size, size_t alignment);
+void *macro_local_percpu_ptr(size_t id, size_t size, size_t alignment);
+void *macro_local_percpu_shard_ptr(size_t id, size_t size, size_t alignment, size_t shard);
+size_t macro_percpu_count(void);
 
-#define macro_local(type) (((type *)macro_array(__LINE__, sizeof(type), alignof(type)))[macro_index()])
+const char *macro_function_name(void);
+const char *macro_source_file(void);
+unsigned macro_source_line(void);
+uint64_t macro_function_id(void);
+
+size_t macro_arg_count(void);
+void *macro_arg_ptr(size_t i);
+size_t macro_arg_size(size_t i);
+void *macro_return_ptr(void);
+
+int macro_unlikely(int condition);
+
+uint64_t macro_loop_trip_count(void);
+
+#define MACRO_SKIP __attribute__((annotate("macro_skip")))
+#define MACRO_ONLY __attribute__((annotate("macro_only")))
+
+#define macro_local(type) (*(type *)macro_local_ptr(__LINE__, sizeof(type), alignof(type)))
+#define macro_local_tls(type) (*(type *)macro_local_tls_ptr(__LINE__, sizeof(type), alignof(type)))
+#define macro_local_percpu(type) (*(type *)macro_local_percpu_ptr(__LINE__, sizeof(type), alignof(type)))
+#define macro_local_percpu_id(type, id) (*(type *)macro_local_percpu_ptr(id, sizeof(type), alignof(type)))
+#define macro_local_percpu_shard(type, id, shard) (*(type *)macro_local_percpu_shard_ptr(id, sizeof(type), alignof(type), shard))
+
+// The guarded statement is the else branch so that an else following it binds
+// to an enclosing if instead, as in: if(a) macro_cold f(); else g();
+#define macro_cold if(!macro_unlikely(1)) {} else
 
 #ifdef __cplusplus
 }
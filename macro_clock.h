@@ -0,0 +1,31 @@
+#ifndef MACRO_CLOCK_H
+#define MACRO_CLOCK_H
+
+// Cheapest available timestamp for the runtimes of the bundled macros, in
+// units which are only meaningful relative to CLOCK_MONOTONIC (the TSC on x86
+// and the virtual counter on AArch64, or nanoseconds otherwise).
+
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+static inline uint64_t macro_clock_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#elif defined(__aarch64__)
+  uint64_t value;
+  __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(value));
+  return value;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+#endif
+}
+
+#endif // MACRO_CLOCK_H
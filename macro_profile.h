@@ -0,0 +1,100 @@
+#ifndef MACRO_PROFILE_H
+#define MACRO_PROFILE_H
+
+// Latency histograms of wrapped functions, as used by the macro in
+// macro-profile.c and implemented by the runtime in macro-profile-runtime.c.
+//
+// Every thread records the latency of each function into its own histogram,
+// which is folded into the total of the function once the thread exits. The
+// histograms are log-linear with MACRO_PROFILE_SUB_BUCKETS buckets per power
+// of 2, i.e. with a relative error of at most 1/MACRO_PROFILE_SUB_BUCKETS.
+
+#include "macro_clock.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MACRO_PROFILE_SUB_BUCKET_BITS 3
+#define MACRO_PROFILE_SUB_BUCKETS (1u << MACRO_PROFILE_SUB_BUCKET_BITS)
+#define MACRO_PROFILE_MAX_BITS 48
+#define MACRO_PROFILE_BUCKETS ((MACRO_PROFILE_MAX_BITS - MACRO_PROFILE_SUB_BUCKET_BITS + 1) * MACRO_PROFILE_SUB_BUCKETS)
+
+struct macro_profile_histogram
+{
+  const char *name;
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  uint64_t buckets[MACRO_PROFILE_BUCKETS];
+
+  // The total of the function for the histogram of a thread, and the next
+  // histogram in the list of totals or of the thread.
+  struct macro_profile_histogram *total;
+  struct macro_profile_histogram *next;
+
+  // The thread-local pointer of the macro to the histogram of a thread.
+  struct macro_profile_histogram **slot;
+};
+
+// Cost of reading the clock twice, in clock units, which is subtracted from
+// every measurement.
+extern uint64_t macro_profile_overhead;
+
+// Allocate the histogram of a function for the current thread into the
+// thread-local *slot, and the total of the function in *total if not done
+// already. The histogram is recycled once the thread exits, at which point
+// *slot is cleared. Returns null once the histograms of the thread have been
+// released, i.e. for calls from its later thread-local destructors.
+struct macro_profile_histogram *macro_profile_register(struct macro_profile_histogram **slot, struct macro_profile_histogram **total, const char *name);
+
+// Print the percentiles of every function to the file named by the
+// MACRO_PROFILE_FILE environment variable, or to stderr by default.
+void macro_profile_dump(void);
+
+static inline size_t macro_profile_bucket(uint64_t value)
+{
+  if(value < MACRO_PROFILE_SUB_BUCKETS)
+    return value;
+
+  unsigned exponent = 63 - __builtin_clzll(value);
+  if(exponent >= MACRO_PROFILE_MAX_BITS)
+    return MACRO_PROFILE_BUCKETS - 1;
+
+  unsigned shift = exponent - MACRO_PROFILE_SUB_BUCKET_BITS;
+  return (shift + 1) * MACRO_PROFILE_SUB_BUCKETS + ((value >> shift) & (MACRO_PROFILE_SUB_BUCKETS - 1));
+}
+
+// Return the smallest value which falls into the given bucket.
+static inline uint64_t macro_profile_bucket_value(size_t bucket)
+{
+  if(bucket < MACRO_PROFILE_SUB_BUCKETS)
+    return bucket;
+
+  unsigned shift = bucket / MACRO_PROFILE_SUB_BUCKETS - 1;
+  return (uint64_t)(MACRO_PROFILE_SUB_BUCKETS + bucket % MACRO_PROFILE_SUB_BUCKETS) << shift;
+}
+
+// Only the thread owning the histogram updates it, but it may be read
+// concurrently by a dump.
+static inline void macro_profile_record(struct macro_profile_histogram *histogram, uint64_t start, uint64_t end)
+{
+  uint64_t value = end - start;
+  value = value > macro_profile_overhead ? value - macro_profile_overhead : 0;
+
+  uint64_t *bucket = &histogram->buckets[macro_profile_bucket(value)];
+  __atomic_store_n(bucket, *bucket + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&histogram->count, histogram->count + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&histogram->sum, histogram->sum + value, __ATOMIC_RELAXED);
+  if(value > histogram->max)
+    __atomic_store_n(&histogram->max, value, __ATOMIC_RELAXED);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // MACRO_PROFILE_H
@@ -0,0 +1,159 @@
+#ifndef MACRO_RUNTIME_H
+#define MACRO_RUNTIME_H
+
+// Runtime control of functions the macro is expanded into with
+// -macro-enable=default-on|default-off, and access to the descriptors of
+// wrapped functions and call sites.
+//
+// Functions are numbered in link order over the whole program (or shared
+// library). Only functions have an enable flag, so this numbering skips the
+// call sites and loops wrapped by macro_def_callsite() and macro_def_loop().
+// Descriptors cover all three, in link order with the functions of each module
+// followed by its call sites and then its loops, so that the index of a
+// descriptor is the same as macro_index() with -macro-index-scope=program.
+// Both numberings only agree when no call sites or loops are wrapped, and
+// macro_descriptor_enable_index() maps a descriptor to the index of its enable
+// flag.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern unsigned char __start___macro_enable[] __attribute__((weak, visibility("hidden")));
+extern unsigned char __stop___macro_enable[] __attribute__((weak, visibility("hidden")));
+extern const char *const __start___macro_names[] __attribute__((weak, visibility("hidden")));
+
+enum macro_descriptor_kind
+{
+  MACRO_DESCRIPTOR_FUNCTION = 0,
+  MACRO_DESCRIPTOR_CALL_SITE = 1,
+  MACRO_DESCRIPTOR_LOOP = 2,
+};
+
+// Location of an argument (or of the return value) in the context passed to
+// the original function, if the macro uses the argument builtins.
+struct macro_slot
+{
+  uint32_t offset;
+  uint32_t size;
+};
+
+// Layout of the descriptors emitted by the pass, for which name is the mangled
+// name of the function (or of the callee for call sites, or of the function
+// the loop is outlined into for loops) and id is the MD5 hash of the mangled
+// name as used by LLVM for profile data. slots is null
+// unless the macro uses the argument builtins, in which case slots[arg_count]
+// is the return value (with size 0 for void functions). enable points to the
+// enable flag of functions with -macro-enable, and is null otherwise.
+struct macro_descriptor
+{
+  const char *name;
+  const char *file;
+  unsigned line;
+  unsigned kind;
+  uint64_t id;
+  const struct macro_slot *slots;
+  unsigned arg_count;
+  unsigned context_size;
+  unsigned char *enable;
+};
+
+extern const struct macro_descriptor __start___macro_descriptors[] __attribute__((weak, visibility("hidden")));
+extern const struct macro_descriptor __stop___macro_descriptors[] __attribute__((weak, visibility("hidden")));
+
+static inline size_t macro_function_count(void)
+{
+  return __stop___macro_enable - __start___macro_enable;
+}
+
+static inline const char *macro_function_name_at(size_t index)
+{
+  return __start___macro_names[index];
+}
+
+static inline void macro_set_enabled(size_t index, int enabled)
+{
+  __atomic_store_n(&__start___macro_enable[index], enabled ? 1 : 0, __ATOMIC_RELAXED);
+}
+
+static inline int macro_is_enabled(size_t index)
+{
+  return __atomic_load_n(&__start___macro_enable[index], __ATOMIC_RELAXED);
+}
+
+static inline void macro_enable(size_t index)
+{
+  macro_set_enabled(index, 1);
+}
+
+static inline void macro_disable(size_t index)
+{
+  macro_set_enabled(index, 0);
+}
+
+static inline void macro_enable_all(void)
+{
+  for(size_t i=0; i<macro_function_count(); ++i)
+    macro_set_enabled(i, 1);
+}
+
+static inline void macro_disable_all(void)
+{
+  for(size_t i=0; i<macro_function_count(); ++i)
+    macro_set_enabled(i, 0);
+}
+
+static inline size_t macro_descriptor_count(void)
+{
+  return __stop___macro_descriptors - __start___macro_descriptors;
+}
+
+static inline const struct macro_descriptor *macro_descriptor_at(size_t index)
+{
+  return &__start___macro_descriptors[index];
+}
+
+// Return the index of the enable flag of the function described by the
+// descriptor, or SIZE_MAX for call sites and loops and without -macro-enable.
+static inline size_t macro_descriptor_enable_index(const struct macro_descriptor *descriptor)
+{
+  if(!descriptor->enable)
+    return SIZE_MAX;
+
+  return descriptor->enable - __start___macro_enable;
+}
+
+// Enable or disable every function with the given (mangled) name and return
+// the number of functions found, which may be more than one for functions
+// with internal linkage.
+static inline size_t macro_set_enabled_by_name(const char *name, int enabled)
+{
+  size_t count = 0;
+  for(size_t i=0; i<macro_function_count(); ++i)
+    if(strcmp(macro_function_name_at(i), name) == 0)
+    {
+      macro_set_enabled(i, enabled);
+      ++count;
+    }
+  return count;
+}
+
+static inline size_t macro_enable_by_name(const char *name)
+{
+  return macro_set_enabled_by_name(name, 1);
+}
+
+static inline size_t macro_disable_by_name(const char *name)
+{
+  return macro_set_enabled_by_name(name, 0);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // MACRO_RUNTIME_H
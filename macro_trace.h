@@ -0,0 +1,104 @@
+#ifndef MACRO_TRACE_H
+#define MACRO_TRACE_H
+
+// Low-overhead tracing of function entries and exits, as used by the macro in
+// macro-trace.c and implemented by the runtime in macro-trace-runtime.c.
+//
+// Every thread records events into its own single-producer ring buffer
+// without any locking, which a background thread of the runtime drains into
+// a memory-mapped file. Events are dropped (and counted) rather than blocking
+// the thread if the buffer is full.
+
+#include "macro_clock.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MACRO_TRACE_MAGIC "MTRACE01"
+#define MACRO_TRACE_BUFFER_SIZE (1u << 16)
+
+enum macro_trace_kind
+{
+  MACRO_TRACE_ENTRY = 0,
+  MACRO_TRACE_EXIT = 1,
+};
+
+// Layout of a single event, which is also its layout in the trace file. The
+// top bit of index holds the kind of the event.
+struct macro_trace_event
+{
+  uint64_t timestamp;
+  uint32_t index;
+  uint32_t thread;
+};
+
+// Layout of the header of the trace file, which is followed by event_count
+// events and then name_count NUL-terminated names of wrapped functions (by
+// macro_index()). The clock is given at the start and the end of the trace in
+// both timestamp units and nanoseconds so that timestamps can be converted.
+struct macro_trace_header
+{
+  char magic[8];
+  uint64_t event_count;
+  uint64_t dropped_count;
+  uint64_t name_count;
+  uint64_t start_timestamp;
+  uint64_t start_ns;
+  uint64_t end_timestamp;
+  uint64_t end_ns;
+};
+
+struct macro_trace_buffer
+{
+  // Written by the thread only, except for dropped which is incremented
+  // atomically since exited threads all share the same buffer.
+  uint64_t head;
+  uint64_t dropped;
+  uint32_t thread;
+  char padding0[64 - 2 * sizeof(uint64_t) - sizeof(uint32_t)];
+
+  // Written by the drainer only.
+  uint64_t tail;
+  char padding1[64 - sizeof(uint64_t)];
+
+  struct macro_trace_buffer *next;
+  int retired;
+
+  struct macro_trace_event events[MACRO_TRACE_BUFFER_SIZE];
+};
+
+extern __thread struct macro_trace_buffer *macro_trace_thread_buffer __attribute__((tls_model("initial-exec")));
+
+// Allocate and register the buffer of the current thread, and start the
+// drainer on first use.
+struct macro_trace_buffer *macro_trace_thread_init(void);
+
+static inline void macro_trace_emit(size_t index, enum macro_trace_kind kind)
+{
+  struct macro_trace_buffer *buffer = macro_trace_thread_buffer;
+  if(__builtin_expect(!buffer, 0))
+    buffer = macro_trace_thread_init();
+
+  uint64_t head = buffer->head;
+  if(head - __atomic_load_n(&buffer->tail, __ATOMIC_ACQUIRE) == MACRO_TRACE_BUFFER_SIZE)
+  {
+    __atomic_fetch_add(&buffer->dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  struct macro_trace_event *event = &buffer->events[head & (MACRO_TRACE_BUFFER_SIZE - 1)];
+  event->timestamp = macro_clock_now();
+  event->index = (uint32_t)index | ((uint32_t)kind << 31);
+  event->thread = buffer->thread;
+  __atomic_store_n(&buffer->head, head + 1, __ATOMIC_RELEASE);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // MACRO_TRACE_H
@@ -26,6 +26,32 @@ int bar(int n)
   return a;
 }
 
+// The lambda must not inherit allocsize, which refers to the signature.
+__attribute__((malloc, alloc_size(1))) void *allocate(size_t size)
+{
+  return malloc(size);
+}
+
+// Exceptions unwind through the macro, even if it is nounwind.
+void fail(int n)
+{
+  if(n != 0)
+    throw n;
+}
+
+int recover(int n)
+{
+  try
+  {
+    fail(n);
+  }
+  catch(int e)
+  {
+    return e;
+  }
+  return 0;
+}
+
 void baz(int n, ...)
 {
   va_list ap;
@@ -40,5 +66,8 @@ int main()
   baz(3, bar(1), bar(2), bar(4));
   srand(time(NULL));
   foo();
+  free(allocate(16));
+  if(recover(7) != 7)
+    abort();
   return bar(10);
 }